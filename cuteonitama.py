@@ -1,6 +1,6 @@
 #!/usr/bin/python
 
-import subprocess, datetime, time, argparse, random
+import subprocess, datetime, time, argparse, random, ctypes, shlex
 
 cards = """
 rabbit
@@ -24,7 +24,8 @@ eel
 class Player:
 	def __init__(self, cmd):
 		self.cmd = cmd
-		self.proc = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+		# The command may carry arguments, e.g. "./onitama uoi --threads 4".
+		self.proc = subprocess.Popen(shlex.split(cmd), stdin=subprocess.PIPE, stdout=subprocess.PIPE)
 
 	def send(self, s):
 		self.proc.stdin.write(s.encode("ascii"))
@@ -60,6 +61,56 @@ class Player:
 			pass
 		self.proc.wait()
 
+class LibraryPlayer:
+	"""Runs the engine in process through libonitama.so, with the same interface as Player."""
+
+	def __init__(self, cmd):
+		self.cmd = cmd
+		lib = self.lib = ctypes.CDLL(cmd[len("lib:"):])
+		lib.onitama_new.restype = ctypes.c_void_p
+		lib.onitama_free.argtypes = [ctypes.c_void_p]
+		lib.onitama_card_index.argtypes = [ctypes.c_char_p]
+		lib.onitama_card_name.restype = ctypes.c_char_p
+		lib.onitama_new_game.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_int)]
+		lib.onitama_game_result.argtypes = [ctypes.c_void_p]
+		lib.onitama_turn.argtypes = [ctypes.c_void_p]
+		lib.onitama_find_move.argtypes = [ctypes.c_void_p] + [ctypes.c_int] * 5
+		lib.onitama_apply_move.argtypes = [ctypes.c_void_p, ctypes.c_uint16]
+		lib.onitama_move_info.argtypes = [ctypes.c_void_p, ctypes.c_uint16] + [ctypes.POINTER(ctypes.c_int)] * 5
+		lib.onitama_search.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_double, ctypes.POINTER(ctypes.c_int), ctypes.POINTER(ctypes.c_uint64)]
+		self.session = lib.onitama_new()
+
+	def new_game(self, hand_cards):
+		indices = (ctypes.c_int * 5)(*[self.lib.onitama_card_index(card.encode("ascii")) for card in hand_cards])
+		assert self.lib.onitama_new_game(self.session, indices) == 0
+
+	def move(self, move):
+		card, source_x, source_y, dest_x, dest_y = move.split()
+		m = self.lib.onitama_find_move(self.session, self.lib.onitama_card_index(card.encode("ascii")), int(source_x), int(source_y), int(dest_x), int(dest_y))
+		assert m >= 0 and self.lib.onitama_apply_move(self.session, m) == 0, "Illegal move: %r" % (move,)
+
+	def genmove(self, seconds):
+		result = self.lib.onitama_game_result(self.session)
+		if result != 2:
+			return "win" if result == self.lib.onitama_turn(self.session) else "loss"
+		score, nodes = ctypes.c_int(), ctypes.c_uint64()
+		m = self.lib.onitama_search(self.session, 50, max(0.005, seconds - 0.01), ctypes.byref(score), ctypes.byref(nodes))
+		assert m >= 0, "Search failed"
+		print("info score %i nodes %i" % (score.value, nodes.value))
+		fields = [ctypes.c_int() for _ in range(5)]
+		assert self.lib.onitama_move_info(self.session, m, *map(ctypes.byref, fields)) == 0
+		return "%s %i %i %i %i" % ((self.lib.onitama_card_name(fields[0].value).decode("ascii"),) + tuple(f.value for f in fields[1:]))
+
+	def quit(self):
+		self.lib.onitama_free(self.session)
+		self.session = None
+
+def make_player(cmd):
+	# "lib:path/to/libonitama.so" loads the engine in process instead of running a command.
+	if cmd.startswith("lib:"):
+		return LibraryPlayer(cmd)
+	return Player(cmd)
+
 def write_game(args, p1_name, p2_name, opening, moves, outcome):
 	with open(args.pgn_out, "a+") as f:
 		print('[Event "?"]', file=f)
@@ -81,7 +132,7 @@ def write_game(args, p1_name, p2_name, opening, moves, outcome):
 		print(file=f)
 
 parser = argparse.ArgumentParser()
-parser.add_argument("--engine", metavar="CMD", action="append", help="Engine command.")
+parser.add_argument("--engine", metavar="CMD", action="append", help="Engine command, or lib:PATH to load libonitama.so.")
 parser.add_argument("--pgn-out", metavar="PATH", type=str, default=None, help="PGN path to output games to.")
 parser.add_argument("--tc", metavar="SEC", type=float, default=1.0, help="Seconds per move.")
 
@@ -93,7 +144,7 @@ if __name__ == "__main__":
 	
 	while True:
 		print("Playing %s - %s" % tuple(engine_commands))
-		players = list(map(Player, engine_commands))
+		players = list(map(make_player, engine_commands))
 
 		if not engines_flipped:
 			opening = random.sample(cards, 5)
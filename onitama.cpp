@@ -12,17 +12,46 @@
 #include <thread>
 #include <ctime>
 #include <atomic>
+#include <array>
+#include <mutex>
+#include <condition_variable>
+#include <cmath>
+#include <fstream>
+#include <unordered_set>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <cerrno>
+#include <sstream>
+#include <deque>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
 
 #define USE_TABLE
 //#define USE_KILLER
-//#define CHECK_TIME
+//#define SEARCH_TRACE
+#define CHECK_TIME
 
 #ifndef CHECK_TIME
 constexpr bool time_limit_up = false;
 #endif
 
 std::random_device rd;
-std::mt19937 rng(rd()); // Ugh, only 32 bits of seed.
+thread_local std::mt19937 rng(rd()); // Ugh, only 32 bits of seed.
 //std::mt19937 rng(10001);
 
 enum Player : uint8_t {
@@ -39,7 +68,7 @@ constexpr Square PIECE_CAPTURED = 128;
 constexpr int MAX_LEGAL_MOVES = 4 * 5 * 2;
 constexpr int SCORE_INF = 1000000;
 
-static inline SquareDelta offset_to_delta(std::pair<int, int> p) {
+constexpr SquareDelta offset_to_delta(std::pair<int, int> p) {
 	return p.first + 8 * p.second;
 }
 
@@ -47,42 +76,49 @@ static inline std::pair<int, int> delta_to_offset(SquareDelta sd) {
 	return {sd % 8, sd / 8};
 }
 
-std::vector<std::vector<std::pair<int, int>>> cards_source{
+constexpr int CARD_COUNT = 16;
+
+struct CardSource {
+	int jump_count;
+	std::pair<int, int> offsets[4];
+};
+
+constexpr CardSource cards_source[CARD_COUNT] {
 	// Rabbit
-	{{-1, -1}, {1, 1}, {2, 0}},
+	{3, {{-1, -1}, {1, 1}, {2, 0}}},
 	// Cobra
-	{{-1, 0}, {1, 1}, {1, -1}},
+	{3, {{-1, 0}, {1, 1}, {1, -1}}},
 	// Rooster
-	{{-1, 0}, {-1, -1}, {1, 0}, {1, 1}},
+	{4, {{-1, 0}, {-1, -1}, {1, 0}, {1, 1}}},
 	// Tiger
-	{{0, -1}, {0, 2}},
+	{2, {{0, -1}, {0, 2}}},
 	// Monkey
-	{{-1, -1}, {-1, 1}, {1, -1}, {1, 1}},
+	{4, {{-1, -1}, {-1, 1}, {1, -1}, {1, 1}}},
 	// Crab
-	{{-2, 0}, {0, 1}, {2, 0}},
+	{3, {{-2, 0}, {0, 1}, {2, 0}}},
 	// Crane
-	{{-1, -1}, {0, 1}, {1, -1}},
+	{3, {{-1, -1}, {0, 1}, {1, -1}}},
 	// Frog
-	{{1, -1}, {-1, 1}, {-2, 0}},
+	{3, {{1, -1}, {-1, 1}, {-2, 0}}},
 	// Boar
-	{{-1, 0}, {0, 1}, {1, 0}},
+	{3, {{-1, 0}, {0, 1}, {1, 0}}},
 	// Horse
-	{{-1, 0}, {0, 1}, {0, -1}},
+	{3, {{-1, 0}, {0, 1}, {0, -1}}},
 	// Elephant
-	{{-1, 1}, {-1, 0}, {1, 0}, {1, 1}},
+	{4, {{-1, 1}, {-1, 0}, {1, 0}, {1, 1}}},
 	// Ox
-	{{1, 0}, {0, 1}, {0, -1}},
+	{3, {{1, 0}, {0, 1}, {0, -1}}},
 	// Goose
-	{{-1, 1}, {-1, 0}, {1, 0}, {1, -1}},
+	{4, {{-1, 1}, {-1, 0}, {1, 0}, {1, -1}}},
 	// Dragon
-	{{-2, 1}, {-1, -1}, {1, -1}, {2, 1}},
+	{4, {{-2, 1}, {-1, -1}, {1, -1}, {2, 1}}},
 	// Mantis
-	{{-1, 1}, {0, -1}, {1, 1}},
+	{3, {{-1, 1}, {0, -1}, {1, 1}}},
 	// Eel
-	{{-1, 1}, {-1, -1}, {1, 0}},
+	{3, {{-1, 1}, {-1, -1}, {1, 0}}},
 };
 
-std::vector<std::string> card_names {
+constexpr const char* card_names[CARD_COUNT] {
 	"rabbit",
 	"cobra",
 	"rooster",
@@ -101,7 +137,7 @@ std::vector<std::string> card_names {
 	"eel",
 };
 
-std::vector<int> card_score {
+alignas(64) constexpr int card_score[CARD_COUNT] {
 	// Rabbit
 	3,
 	// Cobra
@@ -137,7 +173,7 @@ std::vector<int> card_score {
 };
 
 Card parse_card_name(std::string card_name) {
-	for (int i = 0; i < card_names.size(); i++)
+	for (int i = 0; i < CARD_COUNT; i++)
 		if (card_names[i] == card_name)
 			return i;
 	throw std::runtime_error("Bad card name: " + card_name);
@@ -148,23 +184,51 @@ struct CardDesc {
 	SquareDelta jumps[4];
 };
 
-std::vector<CardDesc> cards;
-std::vector<uint8_t> square_is_legal(256);
+// Everything below is generated from cards_source at compile time.
+
+constexpr std::array<CardDesc, CARD_COUNT> make_cards() {
+	std::array<CardDesc, CARD_COUNT> result{};
+	for (int card = 0; card < CARD_COUNT; card++) {
+		result[card].jump_count = cards_source[card].jump_count;
+		for (int i = 0; i < cards_source[card].jump_count; i++)
+			result[card].jumps[i] = offset_to_delta(cards_source[card].offsets[i]);
+	}
+	return result;
+}
 
-static void setup_onitama() {
+constexpr std::array<uint8_t, 256> make_square_is_legal() {
+	std::array<uint8_t, 256> result{};
 	for (int y = 0; y < 5; y++)
 		for (int x = 0; x < 5; x++)
-			square_is_legal[offset_to_delta({x, y})] = 1;
-	for (auto card : cards_source) {
-		CardDesc desc;
-		desc.jump_count = card.size();
-		int i = 0;
-		for (std::pair<int, int> offset : card)
-			desc.jumps[i++] = offset_to_delta(offset);
-		cards.push_back(desc);
-	}
+			result[offset_to_delta({x, y})] = 1;
+	return result;
+}
+
+alignas(64) constexpr std::array<CardDesc, CARD_COUNT> cards = make_cards();
+alignas(64) constexpr std::array<uint8_t, 256> square_is_legal = make_square_is_legal();
+
+typedef std::array<std::array<std::array<uint64_t, 40>, CARD_COUNT>, 2> CardReachTable;
+
+constexpr CardReachTable make_card_reach() {
+	CardReachTable result{};
+	for (int player = 0; player < 2; player++)
+		for (int card = 0; card < CARD_COUNT; card++)
+			for (int square = 0; square < 40; square++) {
+				uint64_t reach = 0;
+				for (int i = 0; square_is_legal[square] and i < cards[card].jump_count; i++) {
+					int dest = square + (player == 0 ? cards[card].jumps[i] : -cards[card].jumps[i]);
+					if (dest >= 0 and square_is_legal[dest])
+						reach |= 1ull << dest;
+				}
+				result[player][card][square] = reach;
+			}
+	return result;
 }
 
+// card_reach[player][card][square] is a bitboard (bit i = square i) of where
+// player can jump to from square with card, ignoring what occupies the squares.
+alignas(64) constexpr CardReachTable card_reach = make_card_reach();
+
 /*
 -------------------------
 32 33 34 35 36 | 37 38 39
@@ -201,7 +265,6 @@ static inline void length_four_sort(uint8_t* x) {
 }
 
 constexpr int PRIORITY_COUNT = 5;
-Move moves_scratch[PRIORITY_COUNT][MAX_LEGAL_MOVES];
 
 struct OnitamaState;
 void print_state(const OnitamaState& state);
@@ -244,11 +307,17 @@ struct OnitamaState {
 	}
 
 	template <bool only_loud_moves=false>
+#ifdef SEARCH_TRACE
+	int move_gen(Move* move_buffer, int* priority_counts=nullptr) const {
+#else
 	int move_gen(Move* move_buffer) const {
+#endif
 		const Square* our_pieces   = turn == Player::WHITE ? white_pieces : black_pieces;
 		const Square* their_pieces = turn == Player::WHITE ? black_pieces : white_pieces;
 		const Card* our_hand = turn == Player::WHITE ? white_hand : black_hand;
 		int moves_by_priority[PRIORITY_COUNT]{};
+		// Kept on the stack so that several threads can generate moves at once.
+		Move moves_scratch[PRIORITY_COUNT][MAX_LEGAL_MOVES];
 
 		assert(game_result() == Player::NOBODY);
 
@@ -333,6 +402,11 @@ struct OnitamaState {
 			moves_scratch[0][moves_by_priority[0]++] = our_pieces[0] + (0 << 11);
 			moves_scratch[0][moves_by_priority[0]++] = our_pieces[0] + (1 << 11);
 		}
+#ifdef SEARCH_TRACE
+		// Lets the search trace tell which bucket a move came from.
+		if (priority_counts != nullptr)
+			std::copy(moves_by_priority, moves_by_priority + PRIORITY_COUNT, priority_counts);
+#endif
 		int gen_count = 0;
 		for (int p = 0; p < PRIORITY_COUNT; p++) {
 			for (int i = 0; i < moves_by_priority[p]; i++) {
@@ -392,6 +466,169 @@ struct OnitamaState {
 	}
 };
 
+// ===== Threat detection =====
+
+constexpr Square WHITE_TEMPLE = 2;  // offset_to_delta({2, 0})
+constexpr Square BLACK_TEMPLE = 34; // offset_to_delta({2, 4})
+
+// Bitboard of the given pieces that are still on the board.
+static inline uint64_t piece_bits(const Square* pieces) {
+	uint64_t bits = 0;
+	for (int i = 0; i < 5; i++)
+		if (pieces[i] != PIECE_CAPTURED)
+			bits |= 1ull << pieces[i];
+	return bits;
+}
+
+static inline uint64_t hand_reach(Player player, const Card* hand, Square square) {
+	return card_reach[player][hand[0]][square] | card_reach[player][hand[1]][square];
+}
+
+// Squares player could move a piece to with the hand they hold right now.
+// A move only changes the mover's hand, so this is also what player threatens after the opponent moves.
+static inline uint64_t attacked_squares(const OnitamaState& state, Player player) {
+	const Square* pieces = player == Player::WHITE ? state.white_pieces : state.black_pieces;
+	const Card* hand = player == Player::WHITE ? state.white_hand : state.black_hand;
+	uint64_t attacked = 0;
+	for (int i = 0; i < 5; i++)
+		if (pieces[i] != PIECE_CAPTURED)
+			attacked |= hand_reach(player, hand, pieces[i]);
+	return attacked & ~piece_bits(pieces);
+}
+
+// Pieces of the opponent of player that player could capture with its current hand.
+static inline uint64_t attacked_pieces(const OnitamaState& state, Player player) {
+	const Square* their_pieces = player == Player::WHITE ? state.black_pieces : state.white_pieces;
+	return attacked_squares(state, player) & piece_bits(their_pieces);
+}
+
+// Whether player could capture the enemy king or walk into the enemy temple with its current hand.
+static inline bool has_winning_move(const OnitamaState& state, Player player) {
+	const Square* our_pieces = player == Player::WHITE ? state.white_pieces : state.black_pieces;
+	const Square* their_pieces = player == Player::WHITE ? state.black_pieces : state.white_pieces;
+	const Card* hand = player == Player::WHITE ? state.white_hand : state.black_hand;
+	if (our_pieces[0] == PIECE_CAPTURED or their_pieces[0] == PIECE_CAPTURED)
+		return false;
+	uint64_t temple = 1ull << (player == Player::WHITE ? BLACK_TEMPLE : WHITE_TEMPLE);
+	if (hand_reach(player, hand, our_pieces[0]) & temple & ~piece_bits(our_pieces))
+		return true;
+	uint64_t their_king = 1ull << their_pieces[0];
+	for (int i = 0; i < 5; i++)
+		if (our_pieces[i] != PIECE_CAPTURED and (hand_reach(player, hand, our_pieces[i]) & their_king))
+			return true;
+	return false;
+}
+
+// ===== Packed positions =====
+
+// A non-terminal position packed into 64 bits:
+//   [25 bits] occupancy of the 5x5 board, bit x + 5 * y +
+//   [20 bits] two bits per occupied square in ascending order: 0 = white pawn, 1 = white king, 2 = black pawn, 3 = black king << 25 +
+//   [17 bits] rank of the card deal (swap card, white pair, black pair) << 45 +
+//   [1 bit  ] side to move << 62
+typedef uint64_t PackedPosition;
+
+// Rank of the pair i < j among all pairs drawn from n items.
+static inline int pair_rank(int i, int j, int n) {
+	return i * (2 * n - i - 1) / 2 + (j - i - 1);
+}
+
+static inline void pair_unrank(int rank, int n, int& i, int& j) {
+	for (i = 0; rank >= n - i - 1; i++)
+		rank -= n - i - 1;
+	j = i + 1 + rank;
+}
+
+PackedPosition pack_position(const OnitamaState& state) {
+	uint8_t contents[25]{};
+	for (int i = 0; i < 5; i++) {
+		if (state.white_pieces[i] != PIECE_CAPTURED)
+			contents[state.white_pieces[i] % 8 + 5 * (state.white_pieces[i] / 8)] = i == 0 ? 2 : 1;
+		if (state.black_pieces[i] != PIECE_CAPTURED)
+			contents[state.black_pieces[i] % 8 + 5 * (state.black_pieces[i] / 8)] = i == 0 ? 4 : 3;
+	}
+	uint64_t occupancy = 0, kinds = 0;
+	int kind_index = 0;
+	for (int sq = 0; sq < 25; sq++) {
+		if (contents[sq] == 0)
+			continue;
+		occupancy |= 1ull << sq;
+		kinds |= uint64_t(contents[sq] - 1) << (2 * kind_index++);
+	}
+	// Rank the deal: pick the swap card, then the white pair from what's left, then the black pair.
+	std::vector<Card> remaining;
+	for (Card c = 0; c < 16; c++)
+		if (c != state.swap_card)
+			remaining.push_back(c);
+	auto index_of = [&](Card c) {
+		return int(std::find(remaining.begin(), remaining.end(), c) - remaining.begin());
+	};
+	Card w0 = std::min(state.white_hand[0], state.white_hand[1]), w1 = std::max(state.white_hand[0], state.white_hand[1]);
+	int white_rank = pair_rank(index_of(w0), index_of(w1), 15);
+	remaining.erase(remaining.begin() + index_of(w1));
+	remaining.erase(remaining.begin() + index_of(w0));
+	Card b0 = std::min(state.black_hand[0], state.black_hand[1]), b1 = std::max(state.black_hand[0], state.black_hand[1]);
+	int black_rank = pair_rank(index_of(b0), index_of(b1), 13);
+	uint64_t deal = (state.swap_card * 105 + white_rank) * 78 + black_rank;
+	return occupancy | (kinds << 25) | (deal << 45) | (uint64_t(state.turn) << 62);
+}
+
+// Whether packed could have come from pack_position: one king and at most four pawns a side,
+// a deal rank in range and no bits above the side to move.
+bool valid_packed_position(PackedPosition packed) {
+	if ((packed >> 63) != 0 or ((packed >> 45) & ((1 << 17) - 1)) >= 16 * 105 * 78)
+		return false;
+	int occupied = __builtin_popcountll(packed & ((1 << 25) - 1));
+	if (occupied > 10)
+		return false;
+	int kind_counts[4]{};
+	for (int i = 0; i < occupied; i++)
+		kind_counts[(packed >> (25 + 2 * i)) & 3]++;
+	return kind_counts[0] <= 4 and kind_counts[1] == 1 and kind_counts[2] <= 4 and kind_counts[3] == 1;
+}
+
+// Inverse of pack_position; the result is canonicalized.
+OnitamaState unpack_position(PackedPosition packed) {
+	OnitamaState state;
+	std::fill(state.white_pieces, state.white_pieces + 5, PIECE_CAPTURED);
+	std::fill(state.black_pieces, state.black_pieces + 5, PIECE_CAPTURED);
+	int white_pawns = 1, black_pawns = 1, kind_index = 0;
+	for (int sq = 0; sq < 25; sq++) {
+		if (not ((packed >> sq) & 1))
+			continue;
+		int kind = (packed >> (25 + 2 * kind_index++)) & 3;
+		Square square = offset_to_delta({sq % 5, sq / 5});
+		if (kind == 0)
+			state.white_pieces[white_pawns++] = square;
+		else if (kind == 1)
+			state.white_pieces[0] = square;
+		else if (kind == 2)
+			state.black_pieces[black_pawns++] = square;
+		else
+			state.black_pieces[0] = square;
+	}
+	int deal = (packed >> 45) & ((1 << 17) - 1);
+	int black_rank = deal % 78;
+	int white_rank = deal / 78 % 105;
+	state.swap_card = deal / 78 / 105;
+	std::vector<Card> remaining;
+	for (Card c = 0; c < 16; c++)
+		if (c != state.swap_card)
+			remaining.push_back(c);
+	int i, j;
+	pair_unrank(white_rank, 15, i, j);
+	state.white_hand[0] = remaining[i];
+	state.white_hand[1] = remaining[j];
+	remaining.erase(remaining.begin() + j);
+	remaining.erase(remaining.begin() + i);
+	pair_unrank(black_rank, 13, i, j);
+	state.black_hand[0] = remaining[i];
+	state.black_hand[1] = remaining[j];
+	state.turn = static_cast<Player>((packed >> 62) & 1);
+	state.canonicalize();
+	return state;
+}
+
 #if 0
 
 int default_king_score_table[40] = {
@@ -412,7 +649,7 @@ int default_pawn_score_table[40] = {
 
 #elif 1
 
-std::vector<int> default_king_score_table{
+alignas(64) constexpr std::array<int, 40> default_king_score_table{
 	-35, -19,  13, -19, -35,   0, 0, 0,
 	-21,  -9,  -2,  -9, -21,   0, 0, 0,
 	-18,  36,  59,  36, -18,   0, 0, 0,
@@ -420,7 +657,7 @@ std::vector<int> default_king_score_table{
 	107, 167, 200, 167, 107,   0, 0, 0,
 };
 
-std::vector<int> default_pawn_score_table{
+alignas(64) constexpr std::array<int, 40> default_pawn_score_table{
 	-5,  -2, -13,  -2,  -5,   0, 0, 0,
 	 2,  14,  15,  14,   2,   0, 0, 0,
 	17,  44,  68,  44,  17,   0, 0, 0,
@@ -430,7 +667,7 @@ std::vector<int> default_pawn_score_table{
 
 #else
 
-std::vector<int> default_king_score_table{
+alignas(64) constexpr std::array<int, 40> default_king_score_table{
 	-29, -21,  -8, -21, -29,   0, 0, 0,
 	-10,  -2,   2,  -2, -10,   0, 0, 0,
 	 16,  29,  45,  29,  16,   0, 0, 0,
@@ -438,7 +675,7 @@ std::vector<int> default_king_score_table{
 	 64, 100, 200, 100,  64,   0, 0, 0,
 };
 
-std::vector<int> default_pawn_score_table{
+alignas(64) constexpr std::array<int, 40> default_pawn_score_table{
 	  6,   5,  11,   5,   6,   0, 0, 0,
 	  5,   8,   7,   8,   5,   0, 0, 0,
 	  3,   6,  10,   6,   3,   0, 0, 0,
@@ -448,11 +685,260 @@ std::vector<int> default_pawn_score_table{
 
 #endif
 
+// Weights of the card dependent evaluation terms, per unit of each term.
+// They are all off until tuned; set them with --eval-weights to try them.
+struct EvalWeights {
+	// Empty or enemy squares a side's pieces can move to with its hand.
+	int mobility = 0;
+	// Enemy pieces a side could capture with its hand.
+	int attacks = 0;
+	// Pieces that reach the enemy king with the hand.
+	int king_attackers = 0;
+	// Pieces that reach the enemy king with the card the side is sure to pick up next.
+	int incoming_king_attackers = 0;
+
+	bool any() const {
+		return mobility != 0 or attacks != 0 or king_attackers != 0 or incoming_king_attackers != 0;
+	}
+};
+
+// Parses "name=value,..." into the named fields, leaving the rest untouched.
+void parse_named_values(const std::string& text, std::initializer_list<std::pair<const char*, int*>> fields) {
+	size_t start = 0;
+	while (start < text.size()) {
+		size_t end = text.find(',', start);
+		if (end == std::string::npos)
+			end = text.size();
+		std::string item = text.substr(start, end - start);
+		size_t equals = item.find('=');
+		if (equals == std::string::npos)
+			throw std::runtime_error("Bad setting: " + item);
+		std::string name = item.substr(0, equals);
+		auto field = std::find_if(fields.begin(), fields.end(), [&name](const std::pair<const char*, int*>& f) {
+			return name == f.first;
+		});
+		if (field == fields.end())
+			throw std::runtime_error("Unknown setting: " + name);
+		*field->second = std::stoi(item.substr(equals + 1));
+		start = end + 1;
+	}
+}
+
+// Parses "mobility=2,attacks=8,...", leaving unnamed weights at their defaults.
+EvalWeights parse_eval_weights(const std::string& text) {
+	EvalWeights weights;
+	parse_named_values(text, {
+		{"mobility", &weights.mobility},
+		{"attacks", &weights.attacks},
+		{"king_attackers", &weights.king_attackers},
+		{"incoming_king_attackers", &weights.incoming_king_attackers},
+	});
+	return weights;
+}
+
 uint64_t state_to_hash(const OnitamaState& state) {
 	const uint64_t* as_blocks = reinterpret_cast<const uint64_t*>(&state);
-	return as_blocks[0] + as_blocks[1]  * 7;
+	// The table indexes with the low bits and tags with the high bits, so mix everything.
+	uint64_t h = as_blocks[0] * 0x9e3779b97f4a7c15ull + as_blocks[1];
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 29;
+	return h;
+}
+
+// ===== Large table allocation =====
+
+enum PageMode : uint8_t {
+	PAGES_NORMAL           = 0,
+	// madvise(MADV_HUGEPAGE), left to the kernel's transparent huge page support.
+	PAGES_TRANSPARENT_HUGE = 1,
+	// MAP_HUGETLB from the reserved huge page pool, falling back to transparent huge pages.
+	PAGES_EXPLICIT_HUGE    = 2,
+};
+
+struct MemoryPolicy {
+	PageMode page_mode = PAGES_TRANSPARENT_HUGE;
+	// Spread pages round-robin over all NUMA nodes, so every searching thread sees the same average latency.
+	bool numa_interleave = false;
+	// Or bind all pages to one node, for tables used by threads pinned near it (-1 = no binding).
+	int numa_node = -1;
+};
+
+PageMode parse_page_mode(const std::string& name) {
+	if (name == "normal")
+		return PAGES_NORMAL;
+	if (name == "thp")
+		return PAGES_TRANSPARENT_HUGE;
+	if (name == "huge")
+		return PAGES_EXPLICIT_HUGE;
+	throw std::runtime_error("Bad page mode: " + name);
+}
+
+const char* page_mode_name(PageMode mode) {
+	return mode == PAGES_NORMAL ? "normal" : mode == PAGES_TRANSPARENT_HUGE ? "thp" : "huge";
 }
 
+// Number of NUMA nodes the kernel knows about, or 1 if it won't say.
+static int numa_node_count() {
+	std::ifstream f("/sys/devices/system/node/possible");
+	std::string range;
+	if (not (f >> range))
+		return 1;
+	size_t dash = range.find('-');
+	return dash == std::string::npos ? 1 : std::stoi(range.substr(dash + 1)) + 1;
+}
+
+// Zeroed anonymous memory for big tables, with the requested page size and NUMA placement
+// where the system allows it and silent fallback to ordinary pages where it doesn't.
+struct LargeBuffer {
+	static constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+
+	void* data = nullptr;
+	size_t size = 0;
+	PageMode page_mode = PAGES_NORMAL;
+
+	LargeBuffer() {}
+	LargeBuffer(const LargeBuffer&) = delete;
+	LargeBuffer& operator=(const LargeBuffer&) = delete;
+	~LargeBuffer() {
+		release();
+	}
+
+	void allocate(size_t bytes, const MemoryPolicy& policy) {
+		release();
+		size = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		page_mode = policy.page_mode;
+#ifdef MAP_HUGETLB
+		if (page_mode == PAGES_EXPLICIT_HUGE) {
+			data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (data == MAP_FAILED)
+				data = nullptr;
+		}
+#endif
+		if (data == nullptr) {
+			if (page_mode == PAGES_EXPLICIT_HUGE)
+				page_mode = PAGES_TRANSPARENT_HUGE;
+			// Over-allocate so the table can start on a huge page boundary, then trim.
+			size_t padded = size + HUGE_PAGE_SIZE;
+			char* p = static_cast<char*>(mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+			if (p == MAP_FAILED)
+				throw std::bad_alloc();
+			char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+			if (aligned != p)
+				munmap(p, aligned - p);
+			munmap(aligned + size, p + padded - (aligned + size));
+			data = aligned;
+#ifdef MADV_HUGEPAGE
+			if (page_mode == PAGES_TRANSPARENT_HUGE and madvise(data, size, MADV_HUGEPAGE) != 0)
+				page_mode = PAGES_NORMAL;
+#else
+			page_mode = PAGES_NORMAL;
+#endif
+		}
+#ifdef SYS_mbind
+		// The pages aren't touched yet, so the policy decides where each one lands.
+		int nodes = numa_node_count();
+		if (nodes > 1 and nodes <= 64 and (policy.numa_interleave or policy.numa_node >= 0)) {
+			constexpr int MPOL_BIND_MODE = 2, MPOL_INTERLEAVE_MODE = 3;
+			unsigned long node_mask = policy.numa_interleave ? (nodes == 64 ? ~0ul : (1ul << nodes) - 1) : 1ul << (policy.numa_node % nodes);
+			syscall(SYS_mbind, data, size, policy.numa_interleave ? MPOL_INTERLEAVE_MODE : MPOL_BIND_MODE, &node_mask, nodes + 1, 0);
+		}
+#endif
+	}
+
+	void release() {
+		if (data != nullptr)
+			munmap(data, size);
+		data = nullptr;
+		size = 0;
+	}
+};
+
+// Fixed size, always-replace table of hash moves.
+// Each entry is the top 48 bits of the hash, the tag of the searcher that stored it in the
+// next four, and the move in the low twelve. Entries are single words read and written
+// with relaxed atomics, so threads can share a table without locks or torn entries.
+struct MoveOrderTable {
+	static constexpr uint64_t MOVE_MASK = 0xfff;
+
+	LargeBuffer buffer;
+	uint64_t* entries;
+	uint64_t entry_count;
+	uint64_t mask;
+	// Stored with our entries, so sharing searchers can tell whose entries they hit.
+	uint64_t writer_tag = 0;
+
+	MoveOrderTable(int log2_entries=22, const MemoryPolicy& policy=MemoryPolicy()) {
+		resize(log2_entries, policy);
+	}
+
+	void resize(int log2_entries, const MemoryPolicy& policy=MemoryPolicy()) {
+		entry_count = 1ull << log2_entries;
+		buffer.allocate(entry_count * sizeof(uint64_t), policy);
+		entries = static_cast<uint64_t*>(buffer.data);
+		mask = entry_count - 1;
+	}
+
+	// Largest power of two table that fits in megabytes.
+	void resize_megabytes(size_t megabytes, const MemoryPolicy& policy=MemoryPolicy()) {
+		int log2_entries = 10;
+		while ((sizeof(uint64_t) << (log2_entries + 1)) <= (megabytes << 20))
+			log2_entries++;
+		resize(log2_entries, policy);
+	}
+
+	// Uses other's entries instead of our own, so that several searchers can share one table.
+	void share(const MoveOrderTable& other, int tag) {
+		buffer.release();
+		entries = other.entries;
+		entry_count = other.entry_count;
+		mask = other.mask;
+		// Past fifteen searchers the last tag is shared, which only blurs the foreign hit statistics.
+		writer_tag = std::min(tag, 15);
+	}
+
+	void clear() {
+		std::fill(entries, entries + entry_count, 0);
+	}
+
+	// On a hit, foreign tells whether another searcher stored the entry.
+	bool probe(uint64_t hash, Move& m, bool& foreign) const {
+		uint64_t entry = __atomic_load_n(&entries[hash & mask], __ATOMIC_RELAXED);
+		if (entry == 0 or (entry >> 16) != (hash >> 16))
+			return false;
+		m = entry & MOVE_MASK;
+		foreign = ((entry >> 12) & 15) != writer_tag;
+		return true;
+	}
+
+	// Returns whether this evicted another position's entry.
+	bool store(uint64_t hash, Move m) {
+		uint64_t* slot = &entries[hash & mask];
+		uint64_t old = __atomic_load_n(slot, __ATOMIC_RELAXED);
+		__atomic_store_n(slot, (hash & ~0xffffull) | (writer_tag << 12) | m, __ATOMIC_RELAXED);
+		return old != 0 and (old >> 16) != (hash >> 16);
+	}
+
+	// Occupied entries among the first count, read atomically since other searchers may be storing.
+	size_t occupied(size_t count) const {
+		size_t result = 0;
+		for (size_t i = 0; i < count; i++)
+			result += __atomic_load_n(&entries[i], __ATOMIC_RELAXED) != 0;
+		return result;
+	}
+
+	// Number of occupied entries. This walks the whole table, so only call it for reporting.
+	size_t size() const {
+		return occupied(entry_count);
+	}
+
+	// Occupancy in permille, estimated from the first thousand entries.
+	int hashfull() const {
+		size_t sample = std::min<size_t>(1000, entry_count);
+		return occupied(sample) * 1000 / sample;
+	}
+};
+
 int make_mate_scores_slightly_less_extreme(int score) {
 	if (score < -10000)
 		return score + 1;
@@ -469,18 +955,614 @@ int make_mate_scores_much_less_extreme(int score) {
 	return score;
 }
 
+// ===== Persistent analysis cache =====
+
+// Shared mapping of a whole file, unmapped when destroyed.
+struct MappedFile {
+	void* data = nullptr;
+	size_t size = 0;
+
+	MappedFile() {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() {
+		close();
+	}
+
+	bool open(const std::string& path, bool writable=false) {
+		close();
+		int fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 or st.st_size == 0) {
+			::close(fd);
+			return false;
+		}
+		void* p = mmap(nullptr, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED)
+			return false;
+		data = p;
+		size = st.st_size;
+		return true;
+	}
+
+	void close() {
+		if (data != nullptr)
+			munmap(data, size);
+		data = nullptr;
+		size = 0;
+	}
+};
+
+struct AnalysisCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t entry_count;
+	// Scores are only meaningful for the evaluation that produced them.
+	uint64_t eval_fingerprint;
+};
+
+// The check word is the hash xor the data, so that entries torn by concurrent
+// writers from different processes fail validation instead of returning garbage.
+struct AnalysisCacheEntry {
+	uint64_t check;
+	uint64_t data;
+};
+static_assert(sizeof(AnalysisCacheEntry) == 16, "AnalysisCacheEntry is part of the on-disk format");
+
+constexpr char ANALYSIS_CACHE_MAGIC[8] = {'O', 'N', 'I', 'C', 'A', 'C', 'H', 'E'};
+constexpr uint32_t ANALYSIS_CACHE_VERSION = 1;
+constexpr int ANALYSIS_CACHE_BUCKET = 4;
+
+// Exact scores of deep searches, kept in a memory mapped file that survives
+// between runs and can be mapped by several processes at once.
+struct AnalysisCache {
+	MappedFile file;
+	AnalysisCacheEntry* entries = nullptr;
+	uint64_t mask = 0;
+	bool writable = false;
+	// Shallower results are cheap to recompute, so don't spend cache space on them.
+	int min_depth = 6;
+
+	// Opens an existing cache, or creates one with 2^log2_entries entries if writable.
+	// Returns false if the file is missing (and read only), malformed, or from another evaluation.
+	bool open(const std::string& path, int log2_entries, bool writable_, uint64_t eval_fingerprint) {
+		writable = writable_;
+		entries = nullptr;
+		bool lost_creation_race = false;
+		if (writable and access(path.c_str(), F_OK) != 0 and not create(path, log2_entries, eval_fingerprint)) {
+			if (errno != EEXIST)
+				return false;
+			lost_creation_race = true;
+		}
+		// The process that won a creation race may still be writing the header, so give it a moment.
+		for (int attempt = 0; not open_existing(path, eval_fingerprint); attempt++) {
+			if (not lost_creation_race or attempt == 100)
+				return false;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		return true;
+	}
+
+	bool open_existing(const std::string& path, uint64_t eval_fingerprint) {
+		if (not file.open(path, writable))
+			return false;
+		const AnalysisCacheHeader* header = static_cast<const AnalysisCacheHeader*>(file.data);
+		if (file.size < sizeof(AnalysisCacheHeader) or
+			not std::equal(ANALYSIS_CACHE_MAGIC, ANALYSIS_CACHE_MAGIC + 8, header->magic) or
+			header->version != ANALYSIS_CACHE_VERSION or
+			header->entry_size != sizeof(AnalysisCacheEntry) or
+			header->entry_count < ANALYSIS_CACHE_BUCKET or
+			(header->entry_count & (header->entry_count - 1)) != 0 or
+			file.size != sizeof(AnalysisCacheHeader) + header->entry_count * sizeof(AnalysisCacheEntry) or
+			header->eval_fingerprint != eval_fingerprint
+		) {
+			file.close();
+			return false;
+		}
+		entries = reinterpret_cast<AnalysisCacheEntry*>(static_cast<char*>(file.data) + sizeof(AnalysisCacheHeader));
+		mask = (header->entry_count - 1) & ~uint64_t(ANALYSIS_CACHE_BUCKET - 1);
+		return true;
+	}
+
+	static bool create(const std::string& path, int log2_entries, uint64_t eval_fingerprint) {
+		AnalysisCacheHeader header{};
+		std::copy(ANALYSIS_CACHE_MAGIC, ANALYSIS_CACHE_MAGIC + 8, header.magic);
+		header.version = ANALYSIS_CACHE_VERSION;
+		header.entry_size = sizeof(AnalysisCacheEntry);
+		header.entry_count = 1ull << log2_entries;
+		header.eval_fingerprint = eval_fingerprint;
+		int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (fd < 0)
+			return false;
+		// The entries are left as a sparse hole of zeros, so creation is instant.
+		bool ok = write(fd, &header, sizeof(header)) == sizeof(header) and
+			ftruncate(fd, sizeof(header) + header.entry_count * sizeof(AnalysisCacheEntry)) == 0;
+		::close(fd);
+		return ok;
+	}
+
+	bool is_open() const {
+		return entries != nullptr;
+	}
+
+	static uint64_t pack(int score, int depth, Move move) {
+		return uint32_t(score) | (uint64_t(depth & 0xff) << 32) | (uint64_t(move) << 40);
+	}
+
+	bool probe(uint64_t hash, int depth, int& score, Move& move) const {
+		const AnalysisCacheEntry* bucket = &entries[hash & mask];
+		for (int i = 0; i < ANALYSIS_CACHE_BUCKET; i++) {
+			uint64_t data = bucket[i].data;
+			if ((bucket[i].check ^ data) != hash or data == 0)
+				continue;
+			if (int((data >> 32) & 0xff) < depth)
+				return false;
+			score = int32_t(data);
+			move = data >> 40;
+			return true;
+		}
+		return false;
+	}
+
+	void store(uint64_t hash, int depth, int score, Move move) {
+		if (not writable)
+			return;
+		AnalysisCacheEntry* bucket = &entries[hash & mask];
+		// Overwrite this position if present, otherwise the shallowest entry in the bucket.
+		AnalysisCacheEntry* victim = &bucket[0];
+		for (int i = 0; i < ANALYSIS_CACHE_BUCKET; i++) {
+			uint64_t data = bucket[i].data;
+			if ((bucket[i].check ^ data) == hash) {
+				if (int((data >> 32) & 0xff) > depth)
+					return;
+				victim = &bucket[i];
+				break;
+			}
+			if (((data >> 32) & 0xff) < ((victim->data >> 32) & 0xff))
+				victim = &bucket[i];
+		}
+		uint64_t data = pack(score, depth, move);
+		victim->data = data;
+		victim->check = hash ^ data;
+	}
+};
+
+// ===== Search statistics =====
+
+// Counters for a single searching thread. Every thread owns its own copy, so
+// nothing here is shared while searching; merge them with += for reporting.
+struct SearchStats {
+	static constexpr int CUTOFF_BUCKETS = 8;
+
+	uint64_t quiescence_nodes = 0;
+	int seldepth = 0;
+	uint64_t table_probes = 0;
+	uint64_t table_hits = 0;
+	// Beta cutoffs produced by the table move itself.
+	uint64_t table_cutoffs = 0;
+	// Hits on entries another thread stored, and stores that replaced a different position.
+	uint64_t table_foreign_hits = 0;
+	uint64_t table_evictions = 0;
+	uint64_t cache_hits = 0;
+	// Nodes scored as draws because the position already occurred.
+	uint64_t repetitions = 0;
+	uint64_t beta_cutoffs = 0;
+	uint64_t extensions = 0;
+	// How many moves were searched before the cutoff; the last bucket collects the tail.
+	uint64_t cutoff_index_histogram[CUTOFF_BUCKETS]{};
+
+	SearchStats& operator+=(const SearchStats& other) {
+		quiescence_nodes += other.quiescence_nodes;
+		seldepth = std::max(seldepth, other.seldepth);
+		table_probes += other.table_probes;
+		table_hits += other.table_hits;
+		table_cutoffs += other.table_cutoffs;
+		table_foreign_hits += other.table_foreign_hits;
+		table_evictions += other.table_evictions;
+		cache_hits += other.cache_hits;
+		repetitions += other.repetitions;
+		beta_cutoffs += other.beta_cutoffs;
+		extensions += other.extensions;
+		for (int i = 0; i < CUTOFF_BUCKETS; i++)
+			cutoff_index_histogram[i] += other.cutoff_index_histogram[i];
+		return *this;
+	}
+
+	// Copies every counter with relaxed atomic loads and stores, so that a searcher can publish
+	// its counters while another thread reads the published copy.
+	static void copy_relaxed(SearchStats& to, const SearchStats& from) {
+		auto copy = [](auto& a, const auto& b) {
+			__atomic_store_n(&a, __atomic_load_n(&b, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		};
+		copy(to.quiescence_nodes, from.quiescence_nodes);
+		copy(to.seldepth, from.seldepth);
+		copy(to.table_probes, from.table_probes);
+		copy(to.table_hits, from.table_hits);
+		copy(to.table_cutoffs, from.table_cutoffs);
+		copy(to.table_foreign_hits, from.table_foreign_hits);
+		copy(to.table_evictions, from.table_evictions);
+		copy(to.cache_hits, from.cache_hits);
+		copy(to.repetitions, from.repetitions);
+		copy(to.beta_cutoffs, from.beta_cutoffs);
+		copy(to.extensions, from.extensions);
+		for (int i = 0; i < CUTOFF_BUCKETS; i++)
+			copy(to.cutoff_index_histogram[i], from.cutoff_index_histogram[i]);
+	}
+};
+
+// ===== Search tracing =====
+
+// With SEARCH_TRACE defined, every engine samples one in sample_interval of its interior
+// nodes into a ring buffer, which can be dumped and summarized offline with analyzetrace.
+// Lazy SMP helpers trace into their own buffers, appended to the main one after each search.
+// Without it the hooks in pvs are compiled out entirely.
+
+constexpr uint8_t TRACE_NO_CUTOFF = 255;
+// Priority bucket of a cutoff move that the table or cache moved to the front.
+constexpr uint8_t TRACE_PROMOTED = PRIORITY_COUNT;
+
+enum TraceFlags : uint8_t {
+	TRACE_QUIESCENCE    = 1,
+	TRACE_TABLE_HIT     = 2,
+	// The table move came first and caused the cutoff.
+	TRACE_TABLE_CUTOFF  = 4,
+	TRACE_CACHE_HIT     = 8,
+	// The cutoff move needed a full window re-search after its scout search.
+	TRACE_CUT_RESEARCH  = 16,
+	TRACE_STAND_PAT_CUT = 32,
+};
+
+struct TraceRecord {
+	// Window on entry, and the score returned.
+	int32_t alpha;
+	int32_t beta;
+	int32_t score;
+	uint8_t ply;
+	uint8_t depth;
+	uint8_t move_count;
+	// Moves searched before the cutoff, counted like SearchStats::cutoff_index_histogram.
+	uint8_t cutoff_index;
+	uint8_t cutoff_priority;
+	uint8_t flags;
+	// PVS re-searches done at this node, and how many of them raised alpha.
+	uint8_t researches;
+	uint8_t researches_improved;
+};
+static_assert(sizeof(TraceRecord) == 20, "trace files depend on the record layout");
+
+struct TraceHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t sample_interval;
+	uint32_t reserved;
+	uint64_t record_count;
+	// Records sampled in total, including those the ring buffer overwrote.
+	uint64_t sampled_count;
+};
+
+constexpr char TRACE_MAGIC[8] = {'O', 'N', 'I', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t TRACE_VERSION = 1;
+
+struct SearchTrace {
+	std::vector<TraceRecord> ring = std::vector<TraceRecord>(1 << 16);
+	uint64_t sampled = 0;
+	uint32_t sample_interval = 16;
+	uint32_t countdown = 1;
+
+	// The capacity must be a power of two.
+	void resize(size_t capacity) {
+		ring.assign(capacity, TraceRecord{});
+		sampled = 0;
+	}
+
+	bool sample() {
+		if (--countdown != 0)
+			return false;
+		countdown = sample_interval;
+		return true;
+	}
+
+	void push(const TraceRecord& record) {
+		ring[sampled++ & (ring.size() - 1)] = record;
+	}
+
+	// Pushes the records other still holds, oldest first.
+	void append(const SearchTrace& other) {
+		uint64_t count = std::min<uint64_t>(other.sampled, other.ring.size());
+		for (uint64_t i = other.sampled - count; i < other.sampled; i++)
+			push(other.ring[i & (other.ring.size() - 1)]);
+	}
+
+	// Writes the buffered records oldest first.
+	void dump(const std::string& path) const {
+		std::ofstream out(path, std::ios::binary);
+		if (not out)
+			throw std::runtime_error("Failed to open trace file: " + path);
+		uint64_t count = std::min<uint64_t>(sampled, ring.size());
+		TraceHeader header{};
+		std::copy(TRACE_MAGIC, TRACE_MAGIC + 8, header.magic);
+		header.version = TRACE_VERSION;
+		header.record_size = sizeof(TraceRecord);
+		header.sample_interval = sample_interval;
+		header.record_count = count;
+		header.sampled_count = sampled;
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		for (uint64_t i = sampled - count; i < sampled; i++)
+			out.write(reinterpret_cast<const char*>(&ring[i & (ring.size() - 1)]), sizeof(TraceRecord));
+	}
+};
+
+void analyze_trace(const std::string& path) {
+	std::ifstream in(path, std::ios::binary);
+	TraceHeader header{};
+	if (not in.read(reinterpret_cast<char*>(&header), sizeof(header)) or not std::equal(TRACE_MAGIC, TRACE_MAGIC + 8, header.magic))
+		throw std::runtime_error("Not a trace file: " + path);
+	if (header.version != TRACE_VERSION or header.record_size != sizeof(TraceRecord))
+		throw std::runtime_error("Unsupported trace version: " + path);
+	std::vector<TraceRecord> records(header.record_count);
+	in.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(TraceRecord));
+	if (not in)
+		throw std::runtime_error("Truncated trace file: " + path);
+
+	const char* priority_names[PRIORITY_COUNT + 1] = {"winning", "loud", "temple", "forward", "other", "promoted"};
+	struct Group {
+		uint64_t nodes = 0;
+		uint64_t cutoffs = 0;
+		uint64_t first_move_cutoffs = 0;
+		uint64_t cutoff_index_sum = 0;
+		uint64_t table_hits = 0;
+		uint64_t table_cutoffs = 0;
+		uint64_t cache_hits = 0;
+		uint64_t stand_pat_cutoffs = 0;
+		uint64_t researches = 0;
+		uint64_t researches_improved = 0;
+		uint64_t cut_researches = 0;
+		uint64_t moves = 0;
+		uint64_t cutoff_priority[PRIORITY_COUNT + 1]{};
+		uint64_t cutoff_index_histogram[SearchStats::CUTOFF_BUCKETS]{};
+	};
+	// Main search nodes by remaining depth, with quiescence nodes in the last group.
+	constexpr int DEPTH_GROUPS = 16;
+	Group groups[DEPTH_GROUPS + 1];
+	Group total;
+	for (const TraceRecord& r : records) {
+		int g = (r.flags & TRACE_QUIESCENCE) ? DEPTH_GROUPS : std::min<int>(r.depth, DEPTH_GROUPS - 1);
+		for (Group* group : {&groups[g], &total}) {
+			group->nodes++;
+			group->moves += r.move_count;
+			group->table_hits += (r.flags & TRACE_TABLE_HIT) != 0;
+			group->cache_hits += (r.flags & TRACE_CACHE_HIT) != 0;
+			group->stand_pat_cutoffs += (r.flags & TRACE_STAND_PAT_CUT) != 0;
+			group->researches += r.researches;
+			group->researches_improved += r.researches_improved;
+			if (r.cutoff_index == TRACE_NO_CUTOFF)
+				continue;
+			group->cutoffs++;
+			group->first_move_cutoffs += r.cutoff_index == 0;
+			group->cutoff_index_sum += r.cutoff_index;
+			group->table_cutoffs += (r.flags & TRACE_TABLE_CUTOFF) != 0;
+			group->cut_researches += (r.flags & TRACE_CUT_RESEARCH) != 0;
+			group->cutoff_priority[std::min<int>(r.cutoff_priority, PRIORITY_COUNT)]++;
+			group->cutoff_index_histogram[std::min<int>(r.cutoff_index, SearchStats::CUTOFF_BUCKETS - 1)]++;
+		}
+	}
+
+	auto percent = [](uint64_t part, uint64_t whole) {
+		return whole == 0 ? 0.0 : std::round(1000.0 * part / whole) / 10;
+	};
+	std::cout << "Records: " << header.record_count << " of " << header.sampled_count << " sampled, one node in " << header.sample_interval << std::endl;
+	std::cout << "Cutoffs: " << total.cutoffs << " (" << percent(total.cutoffs, total.nodes) << "% of nodes), first move " << percent(total.first_move_cutoffs, total.cutoffs);
+	std::cout << "%, table move " << percent(total.table_cutoffs, total.cutoffs) << "%, needing a re-search " << percent(total.cut_researches, total.cutoffs) << "%" << std::endl;
+	std::cout << "Cutoff index:";
+	for (int i = 0; i < SearchStats::CUTOFF_BUCKETS; i++)
+		std::cout << " " << (i == SearchStats::CUTOFF_BUCKETS - 1 ? std::to_string(i) + "+" : std::to_string(i)) << ":" << percent(total.cutoff_index_histogram[i], total.cutoffs) << "%";
+	std::cout << std::endl;
+	std::cout << "Cutoff move priority:";
+	for (int p = 0; p <= PRIORITY_COUNT; p++)
+		std::cout << " " << priority_names[p] << ":" << percent(total.cutoff_priority[p], total.cutoffs) << "%";
+	std::cout << std::endl;
+	std::cout << "Re-searches: " << total.researches << " (" << percent(total.researches, total.nodes) << " per 100 nodes), ";
+	std::cout << percent(total.researches_improved, total.researches) << "% raised alpha" << std::endl;
+	std::cout << "depth      nodes  moves  cut%  first%  avgidx  tthit%  ttcut%  cache%  standpat%  research%" << std::endl;
+	for (int g = 0; g <= DEPTH_GROUPS; g++) {
+		const Group& group = groups[g];
+		if (group.nodes == 0)
+			continue;
+		std::string label = g == DEPTH_GROUPS ? "q" : g == DEPTH_GROUPS - 1 ? std::to_string(g) + "+" : std::to_string(g);
+		char line[160];
+		snprintf(line, sizeof(line), "%-6s %10llu %6.1f %5.1f %7.1f %7.2f %7.1f %7.1f %7.1f %10.1f %10.1f",
+			label.c_str(), (unsigned long long)group.nodes, group.moves / (double)group.nodes,
+			percent(group.cutoffs, group.nodes), percent(group.first_move_cutoffs, group.cutoffs),
+			group.cutoffs == 0 ? 0.0 : group.cutoff_index_sum / (double)group.cutoffs,
+			percent(group.table_hits, group.nodes), percent(group.table_cutoffs, group.cutoffs),
+			percent(group.cache_hits, group.nodes), percent(group.stand_pat_cutoffs, group.nodes),
+			percent(group.researches, group.nodes));
+		std::cout << line << std::endl;
+	}
+}
+
+// ===== Search extensions =====
+
+// Which lines pvs searches one ply deeper than nominal. Zero turns a kind off.
+struct SearchExtensions {
+	// Moves after which the mover threatens to take the king or reach the temple.
+	// Off by default: it roughly quadruples the nodes to a given depth, for no significant gain in self-play.
+	int threat = 0;
+	// Table moves that beat every alternative by singular_margin in a reduced depth search.
+	// Off by default: its verification searches cost more than they gained in self-play.
+	int singular = 0;
+	int singular_min_depth = 6;
+	int singular_margin = 60;
+	// Nodes where the side to move has no legal move and must pass.
+	int forced_pass = 1;
+	// Extensions allowed on a single line from the root.
+	int budget = 3;
+};
+
+SearchExtensions parse_search_extensions(const std::string& text) {
+	SearchExtensions extensions;
+	parse_named_values(text, {
+		{"threat", &extensions.threat},
+		{"singular", &extensions.singular},
+		{"singular_min_depth", &extensions.singular_min_depth},
+		{"singular_margin", &extensions.singular_margin},
+		{"forced_pass", &extensions.forced_pass},
+		{"budget", &extensions.budget},
+	});
+	return extensions;
+}
+
+// ===== Time management =====
+
+// Splits a per-move budget into a soft limit (checked between iterations) and a
+// hard limit (enforced mid-iteration by the timer thread in compute_best_move).
+struct TimeManager {
+	typedef std::chrono::steady_clock Clock;
+
+	Clock::time_point start_time;
+	double soft_limit = -1;
+	double hard_limit = -1;
+	// Smoothed ratio between the node counts of successive iterations.
+	double branching_factor = 4.0;
+	// Scales the soft limit up while the root move or score is unsettled.
+	double instability = 1.0;
+	uint64_t previous_iteration_nodes = 0;
+
+	void start(double budget_seconds) {
+		start_time = Clock::now();
+		hard_limit = budget_seconds;
+		soft_limit = budget_seconds * 0.45;
+		branching_factor = 4.0;
+		instability = 1.0;
+		previous_iteration_nodes = 0;
+	}
+
+	double elapsed() const {
+		return std::chrono::duration<double>(Clock::now() - start_time).count();
+	}
+
+	// Called after each completed iteration; returns true if we should not start another.
+	bool should_stop(double iteration_seconds, uint64_t iteration_nodes, bool best_move_changed, int score_drop) {
+		if (hard_limit < 0)
+			return false;
+		if (previous_iteration_nodes > 0 and iteration_nodes > 0) {
+			// Odd and even depths alternate in cost, so keep a geometric running average.
+			double ratio = std::max(1.0, iteration_nodes / (double)previous_iteration_nodes);
+			branching_factor = std::sqrt(branching_factor * ratio);
+		}
+		previous_iteration_nodes = iteration_nodes;
+
+		if (best_move_changed)
+			instability *= 1.6;
+		else if (score_drop > 25)
+			instability *= 1.3;
+		else
+			instability = std::max(1.0, instability * 0.85);
+		instability = std::min(instability, 2.2);
+
+		double now = elapsed();
+		// The next iteration will almost certainly be cut off by the hard limit, so don't bother.
+		if (now + iteration_seconds * branching_factor > hard_limit)
+			return true;
+		return now > soft_limit * instability;
+	}
+};
+
 struct OnitamaEngine {
-	std::unordered_map<uint64_t, Move> move_order_table;
+	MoveOrderTable move_order_table;
 	uint64_t nodes_reached = 0;
+	SearchStats stats;
+	// Distance from the root of the node currently being searched.
+	int ply = 0;
+	SearchExtensions extensions;
+	// Extensions taken on the path to the node currently being searched.
+	int line_extensions = 0;
+	// Print an info line after every completed iteration of compute_best_move.
+	bool print_info = false;
+	// Set on lazy SMP helpers: every PUBLISH_INTERVAL nodes they copy their counters into
+	// published_nodes and published_stats, which the main thread sums into its info lines.
+	static constexpr uint64_t PUBLISH_INTERVAL = 1024;
+	bool publishes_counters = false;
+	uint64_t published_nodes = 0;
+	SearchStats published_stats;
+	// Threads compute_best_move searches with, sharing the move order table.
+	int thread_count = 1;
+	// Root score of the last iteration compute_best_move completed.
+	int last_score = 0;
+	// Hashes of the game's positions before the root, followed by the current search path.
+	// Callers playing a game keep the game part up to date so repetitions can be scored as draws.
+	std::vector<uint64_t> hash_history;
+	// Optional persistent store of deep exact scores, owned by the caller.
+	AnalysisCache* analysis_cache = nullptr;
 	int play_randomization = 10;
-	std::vector<int> king_score_table = default_king_score_table;
-	std::vector<int> pawn_score_table = default_pawn_score_table;
+	int threatened_stand_pat_penalty = 40;
+	// Stored inline, so evaluation needs no pointer chasing.
+	alignas(64) std::array<int, 40> king_score_table = default_king_score_table;
+	alignas(64) std::array<int, 40> pawn_score_table = default_pawn_score_table;
+	EvalWeights eval_weights;
 	std::vector<Move> killer_moves{std::vector<Move>(100, BAD_MOVE)};
 #ifdef CHECK_TIME
-	std::atomic<bool> time_limit_up;
+	std::atomic<bool> time_limit_up{false};
+	std::mutex timer_mutex;
+	std::condition_variable timer_cv;
+	bool search_finished = false;
 #endif
+	TimeManager time_manager;
+#ifdef SEARCH_TRACE
+	SearchTrace trace;
+#endif
+
+	// Identifies the evaluation and search shape, so that cached scores from a different one are rejected.
+	uint64_t eval_fingerprint() const {
+		uint64_t h = 0;
+		for (int x : king_score_table)
+			h = (h ^ uint32_t(x)) * 0x100000001b3ull;
+		for (int x : pawn_score_table)
+			h = (h ^ uint32_t(x)) * 0x100000001b3ull;
+		for (int x : {eval_weights.mobility, eval_weights.attacks, eval_weights.king_attackers, eval_weights.incoming_king_attackers})
+			h = (h ^ uint32_t(x)) * 0x100000001b3ull;
+		for (int x : {extensions.threat, extensions.singular, extensions.singular_min_depth, extensions.singular_margin,
+				extensions.forced_pass, extensions.budget, threatened_stand_pat_penalty})
+			h = (h ^ uint32_t(x)) * 0x100000001b3ull;
+		return h;
+	}
+
+	// What player's cards let its pieces do next: mobility, attacks, and pressure on the enemy king.
+	int card_terms(const OnitamaState& state, Player player) const {
+		const Square* our_pieces = player == Player::WHITE ? state.white_pieces : state.black_pieces;
+		const Square* their_pieces = player == Player::WHITE ? state.black_pieces : state.white_pieces;
+		const Card* hand = player == Player::WHITE ? state.white_hand : state.black_hand;
+		const Card* mover_hand = state.turn == Player::WHITE ? state.white_hand : state.black_hand;
+		uint64_t our_bits = piece_bits(our_pieces);
+		uint64_t their_bits = piece_bits(their_pieces);
+		uint64_t their_king = 1ull << their_pieces[0];
+		uint64_t reach = 0;
+		int king_attackers = 0;
+		int incoming_king_attackers = 0;
+		for (int i = 0; i < 5; i++) {
+			Square square = our_pieces[i];
+			if (square == PIECE_CAPTURED)
+				continue;
+			uint64_t piece_reach = hand_reach(player, hand, square);
+			reach |= piece_reach;
+			king_attackers += (piece_reach & their_king) != 0;
+			// The side to move picks up the swap card. The other side gets whichever card the mover
+			// gives up, and the mover gets to choose, so only reach both of the mover's cards share counts.
+			uint64_t incoming_reach = player == state.turn ? card_reach[player][state.swap_card][square] :
+				card_reach[player][mover_hand[0]][square] & card_reach[player][mover_hand[1]][square];
+			incoming_king_attackers += (incoming_reach & their_king) != 0;
+		}
+		reach &= ~our_bits;
+		return eval_weights.mobility * __builtin_popcountll(reach) + eval_weights.attacks * __builtin_popcountll(reach & their_bits)
+			+ eval_weights.king_attackers * king_attackers + eval_weights.incoming_king_attackers * incoming_king_attackers;
+	}
 
-	int heuristic_score(const OnitamaState& state) {
+	int heuristic_score(const OnitamaState& state) const {
 		// Get one point for each.
 		Player result = state.game_result();
 		if (result != Player::NOBODY)
@@ -500,34 +1582,98 @@ struct OnitamaEngine {
 			else
 				score_for_white -= pawn_score_table[36 - state.black_pieces[i]] / 2;
 		}
+		if (eval_weights.any())
+			score_for_white += card_terms(state, Player::WHITE) - card_terms(state, Player::BLACK);
 		return state.turn == Player::WHITE ? score_for_white : -score_for_white;
 	}
 
+	// Score for declining all loud moves in quiescence.
+	int stand_pat_score(const OnitamaState& state) const {
+		int score = heuristic_score(state);
+		// Passing assumes some quiet move holds the position, which is doubtful when the opponent is threatening to win.
+		if (has_winning_move(state, static_cast<Player>(1 - state.turn)))
+			score -= threatened_stand_pat_penalty;
+		return score;
+	}
+
+	// Whether the position occurred earlier in the game or on the search path.
+	bool is_repetition(uint64_t hash) const {
+		// Only every other position has the same side to move.
+		for (int i = int(hash_history.size()) - 2; i >= 0; i -= 2)
+			if (hash_history[i] == hash)
+				return true;
+		return false;
+	}
+
+	void publish_counters() {
+		__atomic_store_n(&published_nodes, nodes_reached, __ATOMIC_RELAXED);
+		SearchStats::copy_relaxed(published_stats, stats);
+	}
+
 	template <bool quiescence=false>
 	int pvs(const OnitamaState& state, int depth, int alpha, int beta, Move* best_move_seen_ptr=nullptr, bool apply_randomization=false) {
 		if (time_limit_up)
 			return 123456789;
 		nodes_reached++;
+		if (publishes_counters and nodes_reached % PUBLISH_INTERVAL == 0)
+			publish_counters();
+		if (quiescence)
+			stats.quiescence_nodes++;
+		if (ply > stats.seldepth)
+			stats.seldepth = ply;
 		Player result = state.game_result();
+		uint64_t state_hash = quiescence ? 0 : state_to_hash(state);
+		// Loud moves are all irreversible, so only the main search can repeat positions.
+		if ((not quiescence) and ply > 0 and is_repetition(state_hash)) {
+			stats.repetitions++;
+			return 0;
+		}
 		if (depth == 0 or result != Player::NOBODY) {
 			if (quiescence or (result != Player::NOBODY))
 				return heuristic_score(state);
 			return make_mate_scores_much_less_extreme(pvs<true>(state, 10, alpha, beta));
 		}
 
-		constexpr int MAX_PADDING = 2;
+		// One slot for each move promote_move can put in front: the killer, cached and table moves.
+		constexpr int MAX_PADDING = 3;
 		Move raw_moves[MAX_LEGAL_MOVES + MAX_PADDING];
 		Move* moves = raw_moves + MAX_PADDING;
 
+		if (quiescence) {
+			// A win on the board ends the line, so there is no need to generate and try moves.
+			if (has_winning_move(state, state.turn))
+				return make_mate_scores_slightly_less_extreme(99999);
+			// Without captures there are no loud moves, so the line is quiet already.
+			if (attacked_pieces(state, state.turn) == 0)
+				return stand_pat_score(state);
+		}
+
+#ifdef SEARCH_TRACE
+		int priority_counts[PRIORITY_COUNT];
+		int move_count = state.move_gen<quiescence>(moves, priority_counts);
+#else
 		int move_count = state.move_gen<quiescence>(moves);
+#endif
 		if (quiescence and move_count == 0)
-			return heuristic_score(state);
+			return stand_pat_score(state);
 		assert(move_count > 0);
+		// Pass moves are only generated when nothing else is legal, and are the king "moving" to its own square.
+		const Square* mover_pieces = state.turn == Player::WHITE ? state.white_pieces : state.black_pieces;
+		bool forced_pass = (not quiescence) and (moves[0] & 0x7ff) == mover_pieces[0];
+#ifdef SEARCH_TRACE
+		// Promotions below blank out the moves' original slots, so remember where the buckets were first.
+		Move* generated_moves = moves;
+		bool traced = trace.sample();
+		TraceRecord trace_record{alpha, beta, 0, uint8_t(std::min(ply, 255)), uint8_t(depth), uint8_t(move_count), TRACE_NO_CUTOFF, 0, 0, 0, 0};
+		if (quiescence)
+			trace_record.flags |= TRACE_QUIESCENCE;
+#endif
 
-		auto promote_move = [&moves, &move_count](Move m) {
+		auto promote_move = [&moves, &move_count, &raw_moves](Move m) {
 			// Move this move to the front of the queue.
 			for (int i = 0; i < move_count; i++) {
 				if (moves[i] == m) {
+					assert(moves > raw_moves);
 					moves[i] = BAD_MOVE;
 					moves--;
 					moves[0] = m;
@@ -543,42 +1689,108 @@ struct OnitamaEngine {
 			promote_move(killer_moves[depth]);
 #endif
 
+		bool use_cache = (not quiescence) and analysis_cache != nullptr and depth >= analysis_cache->min_depth;
+		if (use_cache) {
+			int cached_score;
+			Move cached_move;
+			if (analysis_cache->probe(state_hash, depth, cached_score, cached_move)) {
+				stats.cache_hits++;
+#ifdef SEARCH_TRACE
+				trace_record.flags |= TRACE_CACHE_HIT;
+#endif
+				// At the root we still need to pick (and maybe randomize) a move.
+				if (best_move_seen_ptr == nullptr)
+					return cached_score;
+				promote_move(cached_move);
+			}
+		}
+
 #ifdef USE_TABLE
-		uint64_t state_hash;
+		Move table_move = BAD_MOVE;
 		// Reorder our moves according to our table.
 		if (not quiescence) {
-			state_hash = state_to_hash(state);
-			auto it = move_order_table.find(state_hash);
-			if (it != move_order_table.end())
-				promote_move(it->second);
+			stats.table_probes++;
+			bool foreign;
+			if (move_order_table.probe(state_hash, table_move, foreign)) {
+				stats.table_hits++;
+				stats.table_foreign_hits += foreign;
+#ifdef SEARCH_TRACE
+				trace_record.flags |= TRACE_TABLE_HIT;
+#endif
+				promote_move(table_move);
+			}
 		}
 #endif
 
 		int best_score_seen = -SCORE_INF;
 		Move best_move_seen = BAD_MOVE;
+		Move singular_move = BAD_MOVE;
+		int original_alpha = alpha;
+		uint64_t repetitions_before = stats.repetitions;
 
 		// If we're in a quiescence search then you're allowed to pass.
 		if (quiescence) {
-			alpha = std::max(alpha, heuristic_score(state));
-			if (alpha >= beta)
+			alpha = std::max(alpha, stand_pat_score(state));
+			if (alpha >= beta) {
+#ifdef SEARCH_TRACE
+				trace_record.flags |= TRACE_STAND_PAT_CUT;
+#endif
 				goto done_with_search;
+			}
 		}
 
-		for (int i = 0; i < move_count; i++) {
+		if (not quiescence)
+			hash_history.push_back(state_hash);
+#ifdef USE_TABLE
+		if ((not quiescence) and extensions.singular and depth >= extensions.singular_min_depth and table_move != BAD_MOVE and line_extensions < extensions.budget)
+			singular_move = find_singular_move(state, depth, table_move, moves, move_count);
+#endif
+		for (int i = 0, searched = 0; i < move_count; i++) {
 			// Skip sentinels.
 			if (moves[i] == BAD_MOVE)
 				continue;
 			OnitamaState child_state = state;
 			child_state.make_move(moves[i]);
 
+			int extension = 0;
+			if ((not quiescence) and line_extensions < extensions.budget) {
+				if (extensions.forced_pass and forced_pass)
+					extension = 1;
+				else if (moves[i] == singular_move)
+					extension = 1;
+				// A threat the opponent can't answer by winning first has to be parried.
+				else if (extensions.threat and depth > 1 and has_winning_move(child_state, state.turn) and not has_winning_move(child_state, child_state.turn))
+					extension = 1;
+				stats.extensions += extension;
+			}
+			int child_depth = depth - 1 + extension;
+
 			int score;
+#ifdef SEARCH_TRACE
+			bool researched = false;
+#endif
+			ply++;
+			line_extensions += extension;
 			if (i == 0) {
-				score = -pvs<quiescence>(child_state, depth - 1, -beta, - alpha);
+				score = -pvs<quiescence>(child_state, child_depth, -beta, - alpha);
 			} else {
-				score = -pvs<quiescence>(child_state, depth - 1, -alpha - 1, -alpha);
-				if (alpha < score and score < beta)
-					score = -pvs<quiescence>(child_state, depth - 1, -beta, -score);
+				score = -pvs<quiescence>(child_state, child_depth, -alpha - 1, -alpha);
+				if (alpha < score and score < beta) {
+					score = -pvs<quiescence>(child_state, child_depth, -beta, -score);
+#ifdef SEARCH_TRACE
+					researched = true;
+#endif
+				}
 			}
+			line_extensions -= extension;
+			ply--;
+#ifdef SEARCH_TRACE
+			if (researched) {
+				trace_record.researches = std::min(trace_record.researches + 1, 255);
+				if (score > alpha)
+					trace_record.researches_improved = std::min(trace_record.researches_improved + 1, 255);
+			}
+#endif
 			int score_for_comparison = score;
 			if (apply_randomization)
 				score_for_comparison += std::uniform_int_distribution<int>(0, play_randomization)(rng);
@@ -588,74 +1800,717 @@ struct OnitamaEngine {
 			}
 #ifdef USE_TABLE
 			if (score > alpha and (not quiescence) and (not time_limit_up))
-				move_order_table[state_hash] = moves[i];
+				stats.table_evictions += move_order_table.store(state_hash, moves[i]);
 #endif
 			alpha = std::max(alpha, score);
 			if (alpha >= beta) {
+				stats.beta_cutoffs++;
+				stats.cutoff_index_histogram[std::min(searched, SearchStats::CUTOFF_BUCKETS - 1)]++;
+#ifdef USE_TABLE
+				if (i == 0 and moves[i] == table_move)
+					stats.table_cutoffs++;
+#endif
+#ifdef SEARCH_TRACE
+				trace_record.cutoff_index = std::min(searched, 254);
+				trace_record.cutoff_priority = TRACE_PROMOTED;
+				if (moves + i >= generated_moves) {
+					int original_index = moves + i - generated_moves;
+					trace_record.cutoff_priority = 0;
+					for (int p = 0, end = priority_counts[0]; original_index >= end; end += priority_counts[++p])
+						trace_record.cutoff_priority = p + 1;
+				}
+#ifdef USE_TABLE
+				if (i == 0 and moves[i] == table_move)
+					trace_record.flags |= TRACE_TABLE_CUTOFF;
+#endif
+				if (researched)
+					trace_record.flags |= TRACE_CUT_RESEARCH;
+#endif
 #ifdef USE_KILLER
 				if ((not quiescence) and (not time_limit_up))
 					killer_moves[depth] = moves[i];
 #endif
 				break;
 			}
+			searched++;
 		}
+		if (not quiescence)
+			hash_history.pop_back();
 		done_with_search:;
 		if (best_move_seen_ptr != nullptr)
 			*best_move_seen_ptr = best_move_seen;
+		// Only scores strictly inside the window are exact, and draws by repetition depend on the path.
+		if (use_cache and original_alpha < alpha and alpha < beta and stats.repetitions == repetitions_before and not time_limit_up)
+			analysis_cache->store(state_hash, depth, make_mate_scores_slightly_less_extreme(alpha), best_move_seen);
+#ifdef SEARCH_TRACE
+		if (traced) {
+			trace_record.score = make_mate_scores_slightly_less_extreme(alpha);
+			trace.push(trace_record);
+		}
+#endif
 		return make_mate_scores_slightly_less_extreme(alpha);
 	}
 
+	// Returns table_move if a reduced depth search finds every other move at least singular_margin worse, else BAD_MOVE.
+	// The table keeps no scores, so the table move's score comes from the same reduced search.
+	Move find_singular_move(const OnitamaState& state, int depth, Move table_move, const Move* moves, int move_count) {
+		int reduced_depth = std::max(1, depth / 2 - 1);
+		OnitamaState child_state = state;
+		child_state.make_move(table_move);
+		ply++;
+		int bound = -pvs(child_state, reduced_depth, -SCORE_INF, SCORE_INF) - extensions.singular_margin;
+		bool singular = true;
+		for (int i = 0; singular and i < move_count; i++) {
+			if (moves[i] == BAD_MOVE or moves[i] == table_move)
+				continue;
+			child_state = state;
+			child_state.make_move(moves[i]);
+			singular = -pvs(child_state, reduced_depth, -bound, -bound + 1) < bound;
+		}
+		ply--;
+		return singular and not time_limit_up ? table_move : BAD_MOVE;
+	}
+
+	void print_info_line(int depth, int score, uint64_t nodes, const SearchStats& search_stats, double seconds) const {
+		double table_hit_rate = search_stats.table_probes == 0 ? 0 : search_stats.table_hits / (double)search_stats.table_probes;
+		std::cout << "info depth " << depth << " seldepth " << search_stats.seldepth;
+		std::cout << " score " << score << " nodes " << nodes << " qnodes " << search_stats.quiescence_nodes;
+		std::cout << " nps " << uint64_t(nodes / std::max(seconds, 1e-6)) << " time " << int(seconds * 1e3);
+		std::cout << " hashfull " << move_order_table.hashfull() << " tthitrate " << int(table_hit_rate * 1000);
+		std::cout << " ttcutoffs " << search_stats.table_cutoffs << " cachehits " << search_stats.cache_hits << " repetitions " << search_stats.repetitions << " cutoffs " << search_stats.beta_cutoffs << " extensions " << search_stats.extensions << " cutoffindex";
+		for (int i = 0; i < SearchStats::CUTOFF_BUCKETS; i++)
+			std::cout << (i == 0 ? " " : ",") << search_stats.cutoff_index_histogram[i];
+		std::cout << std::endl;
+	}
+
 	static void set_limit_up(double time_limit_seconds, OnitamaEngine* self) {
-		std::this_thread::sleep_for(std::chrono::duration<double>(time_limit_seconds));
 #ifdef CHECK_TIME
-		self->time_limit_up = true;
+		// Wait out the hard limit, but wake up early if the search finishes on its own.
+		std::unique_lock<std::mutex> lock(self->timer_mutex);
+		bool finished = self->timer_cv.wait_for(lock, std::chrono::duration<double>(time_limit_seconds), [self]() {
+			return self->search_finished;
+		});
+		if (not finished)
+			self->time_limit_up = true;
+#else
+		std::this_thread::sleep_for(std::chrono::duration<double>(time_limit_seconds));
 #endif
 	}
 
 	Move compute_best_move(const OnitamaState& state, int depth, double time_limit_seconds=-1) {
 #ifdef CHECK_TIME
 		time_limit_up = false;
+		search_finished = false;
 #endif
+		time_manager.start(time_limit_seconds);
+		stats = SearchStats();
+		ply = 0;
+		uint64_t nodes_at_start = nodes_reached;
 		std::unique_ptr<std::thread> t;
 		if (time_limit_seconds != -1)
 			t = std::make_unique<std::thread>(OnitamaEngine::set_limit_up, time_limit_seconds, this);
 
-//		Move moves[MAX_LEGAL_MOVES];
-//		int move_count = state.move_gen(moves);
-//		int best_score_so_far = -SCORE_INF;
+		// Lazy SMP: helpers search the same root through the shared move order table, so the
+		// main thread finds more of its nodes already ordered. Only the main thread's result counts.
+		std::vector<std::unique_ptr<OnitamaEngine>> helpers;
+		std::vector<std::thread> helper_threads;
+		for (int i = 1; i < thread_count; i++) {
+			helpers.push_back(std::make_unique<OnitamaEngine>());
+			OnitamaEngine& helper = *helpers.back();
+			helper.move_order_table.share(move_order_table, i);
+			helper.hash_history = hash_history;
+			helper.threatened_stand_pat_penalty = threatened_stand_pat_penalty;
+			helper.king_score_table = king_score_table;
+			helper.pawn_score_table = pawn_score_table;
+			helper.eval_weights = eval_weights;
+			helper.extensions = extensions;
+			helper.publishes_counters = print_info;
+#ifdef SEARCH_TRACE
+			helper.trace.sample_interval = trace.sample_interval;
+#endif
+			helper_threads.emplace_back([&helper, &state, depth, i]() {
+				// Odd helpers start a ply deeper, so the threads spread over neighbouring iterations.
+				// Once stopped, pvs returns at once, so the remaining iterations cost nothing.
+				for (int i_depth = 1 + i % 2; i_depth <= depth; i_depth++)
+					helper.pvs(state, i_depth, -SCORE_INF, SCORE_INF);
+			});
+		}
+
+		// Our counters plus what the helpers have published so far.
+		auto print_aggregated_info_line = [&](int i_depth, int score) {
+			uint64_t nodes = nodes_reached - nodes_at_start;
+			SearchStats total = stats;
+			for (auto& helper : helpers) {
+				nodes += __atomic_load_n(&helper->published_nodes, __ATOMIC_RELAXED);
+				SearchStats published;
+				SearchStats::copy_relaxed(published, helper->published_stats);
+				total += published;
+			}
+			print_info_line(i_depth, score, nodes, total, time_manager.elapsed());
+		};
+
 		Move best_move = BAD_MOVE;
+		int previous_score = 0;
+		int completed_depth = 0;
 
 		// Iteratively deepen.
 		for (int i_depth = 1; i_depth <= depth; i_depth++) {
-			/*
-			for (int i = 0; i < move_count; i++) {
-				if (time_limit_up && i_depth != 1)
-					break;
-				OnitamaState child_state = state;
-				child_state.make_move(moves[i]);
-				int score = -pvs(child_state, i_depth, -SCORE_INF, SCORE_INF);
-				// Need to check again, because pvs' result might be invalid.
-				if (time_limit_up)
-					break;
-				score += std::uniform_int_distribution<int>(0, play_randomization)(rng);
-				if (score > best_score_so_far) {
-					best_score_so_far = score;
-					best_move = moves[i];
-				}
-			}*/
-			int score = pvs(state, i_depth, -SCORE_INF, SCORE_INF, &best_move, true);
-			if (time_limit_up)
+			double iteration_start = time_manager.elapsed();
+			uint64_t nodes_before = nodes_reached;
+			Move iteration_move = BAD_MOVE;
+			int score = pvs(state, i_depth, -SCORE_INF, SCORE_INF, &iteration_move, true);
+			// An iteration cut off by the hard limit has a meaningless score, but its best move
+			// so far is still better than nothing when no iteration has completed.
+			if (time_limit_up) {
+				if (best_move == BAD_MOVE)
+					best_move = iteration_move;
+				break;
+			}
+			bool best_move_changed = best_move != BAD_MOVE and iteration_move != best_move;
+			int score_drop = i_depth == 1 ? 0 : previous_score - score;
+			best_move = iteration_move;
+			previous_score = score;
+			last_score = score;
+			completed_depth = i_depth;
+			double iteration_seconds = time_manager.elapsed() - iteration_start;
+			if (print_info)
+				print_aggregated_info_line(i_depth, score);
+			if (time_manager.should_stop(iteration_seconds, nodes_reached - nodes_before, best_move_changed, score_drop))
 				break;
-//			std::cout << "info depth " << i_depth << " nodes " << nodes_reached << " score " << score << std::endl;
 		}
 
-		if (t != nullptr)
+		if (t != nullptr) {
+#ifdef CHECK_TIME
+			{
+				std::lock_guard<std::mutex> lock(timer_mutex);
+				search_finished = true;
+			}
+			timer_cv.notify_one();
+#endif
 			t->join();
+		}
+#ifdef CHECK_TIME
+		for (auto& helper : helpers)
+			helper->time_limit_up = true;
+#endif
+		for (size_t i = 0; i < helpers.size(); i++) {
+			helper_threads[i].join();
+			// Joined, so the helper's own counters are final; count them instead of the last publish.
+			helpers[i]->publish_counters();
+		}
+		// The helpers kept searching until stopped, so report everything they did.
+		if (print_info and not helpers.empty() and completed_depth > 0)
+			print_aggregated_info_line(completed_depth, last_score);
+		for (size_t i = 0; i < helpers.size(); i++) {
+			nodes_reached += helpers[i]->nodes_reached;
+			stats += helpers[i]->stats;
+#ifdef SEARCH_TRACE
+			// The helpers' nodes go into the same dump as the main thread's.
+			trace.append(helpers[i]->trace);
+#endif
+		}
+#ifdef CHECK_TIME
+		// Leave the engine usable for direct pvs calls after a search that ran out of time.
+		time_limit_up = false;
+#endif
+
+		// Cut off before the first root move was searched: any legal move beats none.
+		if (best_move == BAD_MOVE) {
+			Move moves[MAX_LEGAL_MOVES];
+			state.move_gen(moves);
+			best_move = moves[0];
+		}
 
 		return best_move;
 	}
 };
 
+// ===== Proof-number search =====
+
+constexpr uint32_t PN_INF = 1u << 30;
+
+enum SolveOutcome : uint8_t {
+	PROVEN_WIN  = 0,
+	PROVEN_LOSS = 1,
+	UNPROVEN    = 2,
+};
+
+struct ProofNumbers {
+	uint32_t pn;
+	uint32_t dn;
+};
+
+static inline uint32_t pn_add(uint32_t a, uint32_t b) {
+	return std::min<uint64_t>(PN_INF, uint64_t(a) + b);
+}
+
+// Proof numbers of the positions df-pn has visited, shared by every thread of a solve.
+// Split into independently locked shards, so threads rarely wait on each other. Entries
+// also count the threads currently searching below them, for virtual proof numbers.
+struct ProofTable {
+	static constexpr int SHARD_COUNT = 64;
+
+	struct Entry {
+		ProofNumbers numbers{1, 1};
+		uint32_t searchers = 0;
+	};
+
+	struct Shard {
+		std::mutex mutex;
+		std::unordered_map<uint64_t, Entry> entries;
+	};
+
+	std::array<Shard, SHARD_COUNT> shards;
+	std::atomic<size_t> entry_count{0};
+
+	Shard& shard(uint64_t hash) {
+		return shards[hash % SHARD_COUNT];
+	}
+
+	// Unvisited positions get {1, 1} and no searchers.
+	Entry find(uint64_t hash) {
+		Shard& s = shard(hash);
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto it = s.entries.find(hash);
+		return it == s.entries.end() ? Entry{} : it->second;
+	}
+
+	// Never overwrites a proof or disproof: another thread's stale numbers must not undo it.
+	void store(uint64_t hash, ProofNumbers numbers) {
+		Shard& s = shard(hash);
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto inserted = s.entries.emplace(hash, Entry{});
+		entry_count += inserted.second;
+		Entry& entry = inserted.first->second;
+		if (entry.numbers.pn != 0 and entry.numbers.dn != 0)
+			entry.numbers = numbers;
+	}
+
+	void add_searcher(uint64_t hash, int delta) {
+		Shard& s = shard(hash);
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto inserted = s.entries.emplace(hash, Entry{});
+		entry_count += inserted.second;
+		inserted.first->second.searchers += delta;
+	}
+
+	size_t size() const {
+		return entry_count;
+	}
+};
+
+// Depth-first proof-number search (df-pn) proving that the attacker wins.
+// Repeating a position on the current path counts as a failure for the attacker,
+// so proofs are always sound, while disproofs only mean "no forced win found".
+// Several solvers can search the same root through one table: each sees the unsolved
+// positions the others are working on scaled up by (1 + searchers), so they spread out.
+struct ProofNumberSolver {
+	Player attacker;
+	std::shared_ptr<ProofTable> table = std::make_shared<ProofTable>();
+	std::unordered_set<uint64_t> path;
+	uint64_t nodes = 0;
+	uint64_t node_budget = 0;
+	size_t max_table_entries = 1 << 24;
+	// Each level of mid takes about a kilobyte of stack, so very long lines give up instead.
+	size_t max_path_length = 2000;
+	// Set by another thread once our result no longer matters.
+	const std::atomic<bool>* abort = nullptr;
+	bool out_of_budget = false;
+
+	// searchers is how many other solvers are below the position right now.
+	ProofNumbers lookup(const OnitamaState& state, uint64_t hash, uint32_t* searchers=nullptr) const {
+		if (searchers != nullptr)
+			*searchers = 0;
+		Player result = state.game_result();
+		if (result != Player::NOBODY)
+			return result == attacker ? ProofNumbers{0, PN_INF} : ProofNumbers{PN_INF, 0};
+		if (path.count(hash))
+			return {PN_INF, 0};
+		ProofTable::Entry entry = table->find(hash);
+		if (searchers != nullptr)
+			*searchers = entry.searchers;
+		return entry.numbers;
+	}
+
+	void mid(const OnitamaState& state, uint64_t hash, uint32_t thpn, uint32_t thdn) {
+		nodes++;
+		if (nodes >= node_budget or table->size() >= max_table_entries or path.size() >= max_path_length or (abort != nullptr and *abort)) {
+			out_of_budget = true;
+			return;
+		}
+		Move moves[MAX_LEGAL_MOVES];
+		int move_count = state.move_gen(moves);
+		OnitamaState children[MAX_LEGAL_MOVES];
+		uint64_t child_hashes[MAX_LEGAL_MOVES];
+		for (int i = 0; i < move_count; i++) {
+			children[i] = state;
+			children[i].make_move(moves[i]);
+			child_hashes[i] = state_to_hash(children[i]);
+		}
+		bool or_node = state.turn == attacker;
+
+		path.insert(hash);
+		table->add_searcher(hash, 1);
+		while (true) {
+			// At OR nodes pn is the min over children and dn the sum; the reverse at AND nodes.
+			// Only the choice of child sees the virtual numbers; what we store stays exact.
+			uint32_t pn = or_node ? PN_INF : 0;
+			uint32_t dn = or_node ? 0 : PN_INF;
+			// Best and second best child by virtual and by exact numbers.
+			int best[2] = {-1, -1};
+			uint32_t best_value[2] = {PN_INF + 1, PN_INF + 1}, second_value[2] = {PN_INF, PN_INF};
+			ProofNumbers best_child[2]{};
+			for (int i = 0; i < move_count; i++) {
+				uint32_t searchers;
+				ProofNumbers c = lookup(children[i], child_hashes[i], &searchers);
+				uint32_t exact = or_node ? c.pn : c.dn;
+				if (or_node) {
+					pn = std::min(pn, c.pn);
+					dn = pn_add(dn, c.dn);
+				} else {
+					pn = pn_add(pn, c.pn);
+					dn = std::min(dn, c.dn);
+				}
+				uint32_t values[2] = {uint32_t(std::min<uint64_t>(PN_INF, uint64_t(exact) * (1 + searchers))), exact};
+				for (int k = 0; k < 2; k++) {
+					if (values[k] < best_value[k]) {
+						second_value[k] = best_value[k];
+						best_value[k] = values[k];
+						best[k] = i;
+						best_child[k] = c;
+					} else if (values[k] < second_value[k]) {
+						second_value[k] = values[k];
+					}
+				}
+			}
+			table->store(hash, {pn, dn});
+			if (pn >= thpn or dn >= thdn or out_of_budget)
+				break;
+			// Follow the virtual choice unless it is already over our threshold, which happens when
+			// other threads hold every child under it; then the exact best still makes progress.
+			int k = (or_node ? best_child[0].pn < thpn : best_child[0].dn < thdn) ? 0 : 1;
+			uint32_t second = std::min(second_value[k], PN_INF);
+			if (or_node) {
+				uint32_t child_thdn = std::min<uint64_t>(PN_INF, uint64_t(thdn) - dn + best_child[k].dn);
+				mid(children[best[k]], child_hashes[best[k]], std::min(thpn, second + 1), child_thdn);
+			} else {
+				uint32_t child_thpn = std::min<uint64_t>(PN_INF, uint64_t(thpn) - pn + best_child[k].pn);
+				mid(children[best[k]], child_hashes[best[k]], child_thpn, std::min(thdn, second + 1));
+			}
+		}
+		table->add_searcher(hash, -1);
+		path.erase(hash);
+	}
+
+	// Returns +1 if proven, -1 if disproven, or 0 if we ran out of node_budget.
+	int solve(const OnitamaState& state) {
+		out_of_budget = false;
+		path.clear();
+		uint64_t hash = state_to_hash(state);
+		ProofNumbers root = lookup(state, hash);
+		if (state.game_result() == Player::NOBODY and root.pn != 0 and root.dn != 0) {
+			mid(state, hash, PN_INF, PN_INF);
+			root = lookup(state, hash);
+		}
+		return root.pn == 0 ? 1 : root.dn == 0 ? -1 : 0;
+	}
+
+	// Number of distinct positions in the proof tree of an already proven state.
+	uint64_t proof_tree_size(const OnitamaState& state) const {
+		std::unordered_set<uint64_t> visited;
+		auto walk = [&](auto& self, const OnitamaState& s) -> uint64_t {
+			if (s.game_result() != Player::NOBODY)
+				return 1;
+			if (not visited.insert(state_to_hash(s)).second)
+				return 0;
+			Move moves[MAX_LEGAL_MOVES];
+			int move_count = s.move_gen(moves);
+			uint64_t total = 1;
+			for (int i = 0; i < move_count; i++) {
+				OnitamaState child = s;
+				child.make_move(moves[i]);
+				if (lookup(child, state_to_hash(child)).pn != 0)
+					continue;
+				total += self(self, child);
+				// One proven move is enough for the attacker.
+				if (s.turn == attacker)
+					break;
+			}
+			return total;
+		};
+		return walk(walk, state);
+	}
+};
+
+struct SolveResult {
+	SolveOutcome outcome = UNPROVEN;
+	uint64_t nodes = 0;
+	uint64_t proof_tree_size = 0;
+	double seconds = 0;
+};
+
+// Runs df-pn for attacker from state itself on thread_count threads sharing one table,
+// each with an equal share of node_budget. Returns +1 if proven, -1 if disproven, or 0 if
+// the budget ran out, and sets proof_tree_size once proven.
+static int solve_shared(const OnitamaState& state, Player attacker, uint64_t node_budget, size_t max_table_entries, int thread_count, SolveResult& totals, uint64_t& proof_tree_size) {
+	auto table = std::make_shared<ProofTable>();
+	std::atomic<bool> stop{false};
+	std::atomic<int> outcome{0};
+	std::mutex totals_mutex;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < thread_count; t++) {
+		threads.emplace_back([&]() {
+			ProofNumberSolver solver;
+			solver.attacker = attacker;
+			solver.table = table;
+			solver.abort = &stop;
+			solver.node_budget = node_budget / thread_count;
+			solver.max_table_entries = max_table_entries;
+			int result = solver.solve(state);
+			if (result != 0) {
+				outcome = result;
+				stop = true;
+			}
+			std::lock_guard<std::mutex> lock(totals_mutex);
+			totals.nodes += solver.nodes;
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+	if (outcome == 1) {
+		ProofNumberSolver solver;
+		solver.attacker = attacker;
+		solver.table = table;
+		proof_tree_size = solver.proof_tree_size(state);
+	}
+	return outcome;
+}
+
+// Tries to prove the game-theoretic value of state within roughly node_budget nodes,
+// with at most max_table_entries proof numbers stored in the table the threads share.
+SolveResult solve_position(const OnitamaState& state, uint64_t node_budget, int thread_count, size_t max_table_entries=1 << 24) {
+	SolveResult result;
+	auto start = std::chrono::steady_clock::now();
+	Player result_now = state.game_result();
+	if (result_now != Player::NOBODY) {
+		result.outcome = result_now == state.turn ? PROVEN_WIN : PROVEN_LOSS;
+		result.proof_tree_size = 1;
+		return result;
+	}
+	// Search the root itself, so df-pn picks the most promising moves rather than taking them in turn.
+	int win = solve_shared(state, state.turn, node_budget, max_table_entries, thread_count, result, result.proof_tree_size);
+	if (win == 1) {
+		result.outcome = PROVEN_WIN;
+	} else if (win == -1) {
+		// No win, so check whether the opponent has a forced win.
+		uint64_t nodes_left = node_budget > result.nodes ? node_budget - result.nodes : 0;
+		Player them = state.turn == Player::WHITE ? Player::BLACK : Player::WHITE;
+		if (solve_shared(state, them, nodes_left, max_table_entries, thread_count, result, result.proof_tree_size) == 1)
+			result.outcome = PROVEN_LOSS;
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return result;
+}
+
+// ===== Monte Carlo tree search =====
+
+enum MctsEvaluation : uint8_t {
+	MCTS_PLAYOUT   = 0,
+	MCTS_HEURISTIC = 1,
+};
+
+struct MctsNode {
+	// Visits include virtual losses from threads currently below this node.
+	std::atomic<uint32_t> visits{0};
+	// Sum of results for the player who made the move into this node, in units of 1/MCTS_VALUE_SCALE.
+	std::atomic<int64_t> value_sum{0};
+	// 0 = leaf, 1 = being expanded, 2 = expanded.
+	std::atomic<uint8_t> expansion{0};
+	Move move = BAD_MOVE;
+	uint8_t child_count = 0;
+	MctsNode* children = nullptr;
+};
+
+constexpr int64_t MCTS_VALUE_SCALE = 1 << 16;
+constexpr uint32_t MCTS_VIRTUAL_LOSS = 3;
+
+// Fixed capacity node pool. Children of a node are carved out as one contiguous block.
+struct MctsArena {
+	std::unique_ptr<MctsNode[]> nodes;
+	size_t capacity = 0;
+	std::atomic<size_t> used{0};
+
+	void reset(size_t new_capacity) {
+		if (new_capacity != capacity) {
+			nodes = std::make_unique<MctsNode[]>(new_capacity);
+			capacity = new_capacity;
+		} else {
+			for (size_t i = 0; i < used and i < capacity; i++) {
+				nodes[i].visits = 0;
+				nodes[i].value_sum = 0;
+				nodes[i].expansion = 0;
+				nodes[i].child_count = 0;
+				nodes[i].children = nullptr;
+			}
+		}
+		used = 0;
+	}
+
+	// Returns nullptr once the arena is full.
+	MctsNode* allocate(int count) {
+		size_t start = used.fetch_add(count);
+		if (start + count > capacity)
+			return nullptr;
+		return &nodes[start];
+	}
+};
+
+// UCT with tree parallelism: every thread descends the same tree, with virtual
+// losses steering concurrent threads towards different lines.
+struct MctsEngine {
+	// Supplies heuristic_score for MCTS_HEURISTIC, so both engines share eval tables.
+	const OnitamaEngine& evaluator;
+	MctsEvaluation evaluation = MCTS_PLAYOUT;
+	int thread_count = 1;
+	double exploration = 1.2;
+	// Heuristic scores are squashed with a logistic of this scale into a win probability.
+	double heuristic_scale = 150;
+	int playout_ply_limit = 100;
+	size_t arena_nodes = 1 << 22;
+	bool print_info = false;
+	MctsArena arena;
+	std::atomic<uint64_t> playouts{0};
+
+	MctsEngine(const OnitamaEngine& evaluator) : evaluator(evaluator) {}
+
+	// Value of state for its side to move, in [0, 1].
+	double evaluate(OnitamaState state) const {
+		Player us = state.turn;
+		if (evaluation == MCTS_HEURISTIC) {
+			if (state.game_result() != Player::NOBODY)
+				return state.game_result() == us ? 1.0 : 0.0;
+			return 1.0 / (1.0 + std::exp(-evaluator.heuristic_score(state) / heuristic_scale));
+		}
+		for (int plies = 0; plies < playout_ply_limit; plies++) {
+			Player result = state.game_result();
+			if (result != Player::NOBODY)
+				return result == us ? 1.0 : 0.0;
+			Move moves[MAX_LEGAL_MOVES];
+			int move_count = state.move_gen(moves);
+			// Always take an immediate win, which move_gen puts first.
+			OnitamaState child = state;
+			child.make_move(moves[0]);
+			if (child.game_result() == Player::NOBODY) {
+				child = state;
+				child.make_move(moves[std::uniform_int_distribution<int>(0, move_count - 1)(rng)]);
+			}
+			state = child;
+		}
+		return 0.5;
+	}
+
+	MctsNode* select_child(MctsNode* node) const {
+		double log_parent = std::log(std::max<uint32_t>(1, node->visits));
+		MctsNode* best = nullptr;
+		double best_value = -1;
+		for (int i = 0; i < node->child_count; i++) {
+			MctsNode* child = &node->children[i];
+			uint32_t visits = child->visits;
+			if (visits == 0)
+				return child;
+			double q = child->value_sum / double(MCTS_VALUE_SCALE) / visits;
+			double value = q + exploration * std::sqrt(log_parent / visits);
+			if (value > best_value) {
+				best_value = value;
+				best = child;
+			}
+		}
+		return best;
+	}
+
+	void expand(MctsNode* node, const OnitamaState& state) {
+		uint8_t expected = 0;
+		if (not node->expansion.compare_exchange_strong(expected, 1))
+			return;
+		Move moves[MAX_LEGAL_MOVES];
+		int move_count = state.move_gen(moves);
+		MctsNode* children = arena.allocate(move_count);
+		if (children == nullptr) {
+			// Out of memory: leave this node as a leaf for good.
+			return;
+		}
+		for (int i = 0; i < move_count; i++)
+			children[i].move = moves[i];
+		node->children = children;
+		node->child_count = move_count;
+		node->expansion.store(2, std::memory_order_release);
+	}
+
+	void run_playout(MctsNode* root, const OnitamaState& root_state) {
+		MctsNode* path[1024];
+		int path_length = 0;
+		OnitamaState state = root_state;
+		MctsNode* node = root;
+		path[path_length++] = node;
+		node->visits += MCTS_VIRTUAL_LOSS;
+		while (node->expansion.load(std::memory_order_acquire) == 2 and path_length < 1024) {
+			node = select_child(node);
+			state.make_move(node->move);
+			path[path_length++] = node;
+			node->visits += MCTS_VIRTUAL_LOSS;
+		}
+		// Expand leaves the second time they are reached, so one-off lines cost no memory.
+		if (state.game_result() == Player::NOBODY and node->visits > MCTS_VIRTUAL_LOSS)
+			expand(node, state);
+		double value = evaluate(state);
+		// value is for the side to move at the leaf; each node stores it for the player who moved into it.
+		for (int i = path_length - 1; i >= 0; i--) {
+			value = 1.0 - value;
+			path[i]->value_sum += int64_t(value * MCTS_VALUE_SCALE);
+			path[i]->visits -= MCTS_VIRTUAL_LOSS - 1;
+		}
+		playouts++;
+	}
+
+	// Searches until max_playouts playouts have been run or the time limit expires (-1 for none).
+	Move compute_best_move(const OnitamaState& state, uint64_t max_playouts, double time_limit_seconds=-1) {
+		auto start = std::chrono::steady_clock::now();
+		auto elapsed = [&]() {
+			return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		};
+		arena.reset(arena_nodes);
+		playouts = 0;
+		MctsNode* root = arena.allocate(1);
+		expand(root, state);
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < thread_count; t++) {
+			threads.emplace_back([&]() {
+				while (playouts < max_playouts) {
+					// Reading the clock every playout is cheap next to the playout itself.
+					if (time_limit_seconds != -1 and elapsed() > time_limit_seconds)
+						break;
+					run_playout(root, state);
+				}
+			});
+		}
+		for (auto& thread : threads)
+			thread.join();
+
+		MctsNode* best = &root->children[0];
+		for (int i = 0; i < root->child_count; i++)
+			if (root->children[i].visits > best->visits)
+				best = &root->children[i];
+		if (print_info) {
+			double seconds = elapsed();
+			std::cout << "info mcts playouts " << playouts << " nodes " << std::min(arena.used.load(), arena.capacity);
+			std::cout << " time " << int(seconds * 1e3) << " pps " << uint64_t(playouts / std::max(seconds, 1e-6));
+			std::cout << " bestvisits " << best->visits << " winrate " << int(1000 * best->value_sum / double(MCTS_VALUE_SCALE) / std::max<uint32_t>(1, best->visits)) << std::endl;
+		}
+		return best->move;
+	}
+};
+
 std::vector<std::string> piece_strings {
 	".",
 	"\033[91mK\033[0m",
@@ -691,6 +2546,34 @@ std::string move_to_string(Move m) {
 	return std::to_string(x) + "," + std::to_string(y) + "p" + std::to_string(piece) + "h" + std::to_string(hand_index);
 }
 
+// Writes m as "card source_x source_y dest_x dest_y", the form used by the uoi protocol.
+std::string move_to_protocol_string(const OnitamaState& state, Move m) {
+	Square dest = m;
+	int piece_index = (m >> 8) & 7;
+	int hand_index = (m >> 11) & 1;
+	const Square* our_pieces = state.turn == Player::WHITE ? state.white_pieces : state.black_pieces;
+	const Card* our_hand = state.turn == Player::WHITE ? state.white_hand : state.black_hand;
+	Square source = our_pieces[piece_index];
+	return std::string(card_names[our_hand[hand_index]]) + " " + std::to_string(source % 8) + " " + std::to_string(source / 8) + " " + std::to_string(dest % 8) + " " + std::to_string(dest / 8);
+}
+
+// Finds the legal move that uses card to go from source to dest, or BAD_MOVE if there is none.
+Move find_move(const OnitamaState& state, Card card, int source_x, int source_y, int dest_x, int dest_y) {
+	const Card* our_hand = state.turn == Player::WHITE ? state.white_hand : state.black_hand;
+	const Square* our_pieces = state.turn == Player::WHITE ? state.white_pieces : state.black_pieces;
+	Move moves[MAX_LEGAL_MOVES];
+	int move_count = state.move_gen(moves);
+	for (int i = 0; i < move_count; i++) {
+		Move m = moves[i];
+		Square dest = m;
+		int piece_index = (m >> 8) & 7;
+		int hand_index = (m >> 11) & 1;
+		if (our_hand[hand_index] == card and our_pieces[piece_index] == offset_to_delta({source_x, source_y}) and dest == offset_to_delta({dest_x, dest_y}))
+			return m;
+	}
+	return BAD_MOVE;
+}
+
 void print_state(const OnitamaState& state) {
 	std::cout << "Turn: " << player_to_string(state.turn) << std::endl;
 	int contains[40]{};
@@ -781,8 +2664,10 @@ int calibration_self_play_game(OnitamaEngine& engine, std::vector<int>& king_win
 			return;
 		dest.at(location)++;
 	};
+	engine.hash_history.clear();
 	while (state.game_result() == Player::NOBODY) {
 		Move m = engine.compute_best_move(state, 5);
+		engine.hash_history.push_back(state_to_hash(state));
 		state.make_move(m);
 		track_piece(state.white_pieces[0], white_king_occurences);
 		track_piece(state.black_pieces[0], black_king_occurences);
@@ -791,7 +2676,8 @@ int calibration_self_play_game(OnitamaEngine& engine, std::vector<int>& king_win
 			track_piece(state.black_pieces[i], black_pawn_occurences);
 		}
 		plies++;
-		if (plies >= 200)
+		// Adjudicate threefold repetition as a draw.
+		if (plies >= 200 or std::count(engine.hash_history.begin(), engine.hash_history.end(), state_to_hash(state)) >= 2)
 			break;
 	}
 	if (state.game_result() == Player::NOBODY)
@@ -889,24 +2775,58 @@ void do_self_play_piece_table_calibration() {
 
 // ===== Elo tournament =====
 
-Player elo_self_play_game(OnitamaEngine& engine1, OnitamaEngine& engine2) {
+// Command line options of the form --name value, or --name alone for flags.
+typedef std::unordered_map<std::string, std::string> Options;
+
+Options parse_options(int argc, char** argv, int first) {
+	Options options;
+	for (int i = first; i < argc; i++) {
+		std::string name = argv[i];
+		if (name.substr(0, 2) != "--")
+			throw std::runtime_error("Bad option: " + name);
+		bool has_value = i + 1 < argc and std::string(argv[i + 1]).substr(0, 2) != "--";
+		options[name.substr(2)] = has_value ? argv[++i] : "1";
+	}
+	return options;
+}
+
+std::string get_option(const Options& options, const std::string& name, const std::string& default_value="") {
+	auto it = options.find(name);
+	return it == options.end() ? default_value : it->second;
+}
+
+// Picks a move for state, given the hashes of the game's earlier positions.
+typedef std::function<Move(const OnitamaState&, const std::vector<uint64_t>&)> MovePicker;
+
+Player elo_self_play_game(const MovePicker& player1, const MovePicker& player2) {
 	Card hand_state[16];
 	for (int i = 0; i < 16; i++)
 		hand_state[i] = i;
 	std::shuffle(&hand_state[0], &hand_state[16], rng);
 	auto state = OnitamaState::starting_state(hand_state);
 	int plies = 0;
+	std::vector<uint64_t> history;
 	while (state.game_result() == Player::NOBODY) {
-		Move m = (plies % 2 == 0 ? engine1 : engine2).compute_best_move(state, 3);
+		Move m = (plies % 2 == 0 ? player1 : player2)(state, history);
+		history.push_back(state_to_hash(state));
 		state.make_move(m);
 		plies++;
-		if (plies >= 100)
+		// Adjudicate threefold repetition as a draw.
+		if (plies >= 100 or std::count(history.begin(), history.end(), state_to_hash(state)) >= 2)
 			break;
 	}
 	return state.game_result();
 }
 
-void do_elo_testing() {
+// Options:
+//   --engine1/--engine2 pvs|mcts   which search each side uses (default pvs)
+//   --scale1/--scale2 X            multiplies the piece-square tables (default 1 and -1)
+//   --movetime SEC                 time per move; 0 means depth 3 for pvs and --playouts for mcts
+//   --playouts N                   playouts per move for mcts without a movetime (default 2000)
+//   --threads N                    mcts threads (default 1)
+//   --mcts-eval playout|heuristic  mcts leaf evaluation (default playout)
+//   --games N                      number of game pairs (default 100)
+void do_elo_testing(const Options& options) {
 	auto fill_with_scale = [](OnitamaEngine& engine, double scale) {
 		for (int i = 0; i < 40; i++) {
 			engine.king_score_table[i] = scale * default_king_score_table[i];
@@ -918,17 +2838,48 @@ void do_elo_testing() {
 	OnitamaEngine engine2;
 	engine1.play_randomization = 10;
 	engine2.play_randomization = 10;
-	fill_with_scale(engine1, 1.0);
-	fill_with_scale(engine2, -1.0);
+	fill_with_scale(engine1, std::stod(get_option(options, "scale1", "1.0")));
+	fill_with_scale(engine2, std::stod(get_option(options, "scale2", "-1.0")));
+	engine1.eval_weights = parse_eval_weights(get_option(options, "weights1"));
+	engine2.eval_weights = parse_eval_weights(get_option(options, "weights2"));
+	engine1.extensions = parse_search_extensions(get_option(options, "extensions1"));
+	engine2.extensions = parse_search_extensions(get_option(options, "extensions2"));
+	MctsEngine mcts1(engine1);
+	MctsEngine mcts2(engine2);
+
+	double movetime = std::stod(get_option(options, "movetime", "0"));
+	uint64_t playouts = std::stoull(get_option(options, "playouts", "2000"));
+	auto make_player = [&](const std::string& kind, OnitamaEngine& engine, MctsEngine& mcts) -> MovePicker {
+		if (kind == "mcts") {
+			mcts.thread_count = std::stoi(get_option(options, "threads", "1"));
+			mcts.evaluation = get_option(options, "mcts-eval", "playout") == "heuristic" ? MCTS_HEURISTIC : MCTS_PLAYOUT;
+			return [&mcts, movetime, playouts](const OnitamaState& state, const std::vector<uint64_t>&) {
+				if (movetime > 0)
+					return mcts.compute_best_move(state, std::numeric_limits<uint64_t>::max(), movetime);
+				return mcts.compute_best_move(state, playouts);
+			};
+		}
+		if (kind != "pvs")
+			throw std::runtime_error("Bad engine kind: " + kind);
+		return [&engine, movetime](const OnitamaState& state, const std::vector<uint64_t>& history) {
+			engine.hash_history = history;
+			if (movetime > 0)
+				return engine.compute_best_move(state, 50, movetime);
+			return engine.compute_best_move(state, 3);
+		};
+	};
+	MovePicker player1 = make_player(get_option(options, "engine1", "pvs"), engine1, mcts1);
+	MovePicker player2 = make_player(get_option(options, "engine2", "pvs"), engine2, mcts2);
 
 	int wins[2]{};
-	for (int i = 0; i < 100; i++) {
-		Player result = elo_self_play_game(engine1, engine2);
+	int games = std::stoi(get_option(options, "games", "100"));
+	for (int i = 0; i < games; i++) {
+		Player result = elo_self_play_game(player1, player2);
 		if (result == Player::WHITE)
 			wins[0]++;
 		if (result == Player::BLACK)
 			wins[1]++;
-		result = elo_self_play_game(engine2, engine1);
+		result = elo_self_play_game(player2, player1);
 		if (result == Player::WHITE)
 			wins[1]++;
 		if (result == Player::BLACK)
@@ -938,8 +2889,1091 @@ void do_elo_testing() {
 
 }
 
-void uoi() {
+// ===== Hardware performance counters =====
+
+// One hardware counter per event, opened independently so that a machine (or
+// container) missing some of them still reports the rest.
+struct PerfCounters {
+	static constexpr int EVENT_COUNT = 4;
+	int fds[EVENT_COUNT] = {-1, -1, -1, -1};
+
+	static const char* event_name(int i) {
+		static const char* names[EVENT_COUNT] = {"cycles", "instructions", "cache-misses", "branch-misses"};
+		return names[i];
+	}
+
+	PerfCounters() {
+#ifdef __linux__
+		uint64_t configs[EVENT_COUNT] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES,
+		};
+		for (int i = 0; i < EVENT_COUNT; i++) {
+			perf_event_attr attr{};
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.size = sizeof(attr);
+			attr.config = configs[i];
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			// With more events than hardware counters the kernel multiplexes them, so we
+			// need the time each one actually counted for to scale it up.
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+#endif
+	}
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	~PerfCounters() {
+		for (int fd : fds)
+			if (fd >= 0)
+				close(fd);
+	}
+
+	bool available(int i) const {
+		return fds[i] >= 0;
+	}
+
+	void start() {
+#ifdef __linux__
+		for (int fd : fds) {
+			if (fd < 0)
+				continue;
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	// Stops counting and returns the counts since start, scaled up for the time a multiplexed
+	// counter was not scheduled; unavailable counters read as 0.
+	std::array<uint64_t, EVENT_COUNT> stop() {
+		std::array<uint64_t, EVENT_COUNT> counts{};
+#ifdef __linux__
+		for (int i = 0; i < EVENT_COUNT; i++) {
+			if (fds[i] < 0)
+				continue;
+			ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+			// value, time_enabled, time_running
+			uint64_t values[3];
+			if (read(fds[i], values, sizeof(values)) != sizeof(values) or values[2] == 0)
+				continue;
+			counts[i] = values[2] == values[1] ? values[0] : uint64_t(double(values[0]) * values[1] / values[2]);
+		}
+#endif
+		return counts;
+	}
+};
+
+// Brackets f with the counters and prints the costs divided by units (nodes or calls).
+template <typename F>
+void measure_phase(PerfCounters& counters, const std::string& phase, const std::string& unit, F f) {
+	auto start = std::chrono::steady_clock::now();
+	counters.start();
+	uint64_t units = f();
+	auto counts = counters.stop();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	units = std::max<uint64_t>(units, 1);
+	std::cout << "phase " << phase << " " << unit << " " << units << " ns/" << unit << " " << seconds * 1e9 / units;
+	for (int i = 0; i < PerfCounters::EVENT_COUNT; i++) {
+		std::cout << " " << PerfCounters::event_name(i) << "/" << unit << " ";
+		if (counters.available(i))
+			std::cout << counts[i] / double(units);
+		else
+			std::cout << "n/a";
+	}
+	if (counters.available(0) and counters.available(1) and counts[0] > 0)
+		std::cout << " ipc " << counts[1] / double(counts[0]);
+	std::cout << std::endl;
+}
+
+// The same deals on every run, so that benchmark results can be compared.
+std::vector<OnitamaState> benchmark_positions(int deal_count, std::mt19937& deal_rng) {
+	std::vector<OnitamaState> roots;
+	for (int i = 0; i < deal_count; i++) {
+		Card hand_state[16];
+		for (int j = 0; j < 16; j++)
+			hand_state[j] = j;
+		std::shuffle(&hand_state[0], &hand_state[16], deal_rng);
+		roots.push_back(OnitamaState::starting_state(hand_state));
+		roots.back().canonicalize();
+	}
+	return roots;
+}
+
+// Options:
+//   --depth N    iterative deepening depth of the search phase (default 9)
+//   --deals N    number of deals, drawn from a fixed seed (default 4)
+//   --repeat N   passes over the sampled positions for the move_gen and eval phases (default 200)
+void do_perf_benchmark(const Options& options) {
+	int depth = std::stoi(get_option(options, "depth", "9"));
+	int deal_count = std::stoi(get_option(options, "deals", "4"));
+	int repeat = std::stoi(get_option(options, "repeat", "200"));
+	PerfCounters counters;
+	bool any_available = false;
+	for (int i = 0; i < PerfCounters::EVENT_COUNT; i++)
+		any_available |= counters.available(i);
+	if (not any_available)
+		std::cout << "info Hardware counters unavailable (perf_event_open failed: check perf_event_paranoid); reporting wall time only" << std::endl;
+
+	std::mt19937 deal_rng(12345);
+	std::vector<OnitamaState> roots = benchmark_positions(deal_count, deal_rng);
+
+	// Search: every node of iterative deepening on every deal. The engines (and their
+	// tables) are set up beforehand, so that allocating them isn't charged to the search.
+	std::vector<std::unique_ptr<OnitamaEngine>> engines;
+	for (size_t i = 0; i < roots.size(); i++)
+		engines.push_back(std::make_unique<OnitamaEngine>());
+	measure_phase(counters, "pvs", "node", [&]() {
+		uint64_t nodes = 0;
+		for (size_t i = 0; i < roots.size(); i++) {
+			for (int d = 1; d <= depth; d++)
+				engines[i]->pvs(roots[i], d, -SCORE_INF, SCORE_INF);
+			nodes += engines[i]->nodes_reached;
+		}
+		return nodes;
+	});
+	engines.clear();
+
+	// Sample positions from random games for the isolated phases.
+	std::vector<OnitamaState> positions;
+	for (const OnitamaState& root : roots) {
+		for (int game = 0; game < 50; game++) {
+			OnitamaState state = root;
+			while (state.game_result() == Player::NOBODY and positions.size() < 100000) {
+				positions.push_back(state);
+				Move moves[MAX_LEGAL_MOVES];
+				int move_count = state.move_gen(moves);
+				state.make_move(moves[deal_rng() % move_count]);
+			}
+		}
+	}
+
+	uint64_t sink = 0;
+	measure_phase(counters, "move_gen", "call", [&]() {
+		Move moves[MAX_LEGAL_MOVES];
+		for (int r = 0; r < repeat; r++)
+			for (const OnitamaState& state : positions)
+				sink += state.move_gen(moves);
+		return uint64_t(repeat) * positions.size();
+	});
 	OnitamaEngine engine;
+	measure_phase(counters, "heuristic_score", "call", [&]() {
+		for (int r = 0; r < repeat; r++)
+			for (const OnitamaState& state : positions)
+				sink += engine.heuristic_score(state);
+		return uint64_t(repeat) * positions.size();
+	});
+	// Keep the isolated loops from being optimized away.
+	if (sink == 42)
+		std::cout << std::endl;
+}
+
+// ===== Thread scaling benchmark =====
+
+struct ScalingResult {
+	int threads;
+	double seconds = 0;
+	uint64_t nodes = 0;
+	SearchStats stats;
+};
+
+// Searches the benchmark deals to a fixed depth with 1, 2, 4, ... threads, and compares each
+// thread count with one thread: time to depth, NPS, extra nodes searched, and table sharing.
+void do_thread_scaling_benchmark(const Options& options) {
+	int depth = std::stoi(get_option(options, "depth", "10"));
+	int deal_count = std::stoi(get_option(options, "deals", "4"));
+	int max_threads = std::stoi(get_option(options, "max-threads", std::to_string(std::max(1u, std::thread::hardware_concurrency()))));
+	// table, csv or json.
+	std::string format = get_option(options, "format", "table");
+	std::vector<int> thread_counts;
+	for (int threads = 1; threads < max_threads; threads *= 2)
+		thread_counts.push_back(threads);
+	thread_counts.push_back(std::max(max_threads, 1));
+
+	std::mt19937 deal_rng(12345);
+	std::vector<OnitamaState> roots = benchmark_positions(deal_count, deal_rng);
+	std::vector<ScalingResult> results;
+	for (int threads : thread_counts) {
+		ScalingResult result;
+		result.threads = threads;
+		for (const OnitamaState& root : roots) {
+			OnitamaEngine engine;
+			engine.thread_count = threads;
+			engine.play_randomization = 0;
+			auto start = std::chrono::steady_clock::now();
+			engine.compute_best_move(root, depth);
+			result.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			result.nodes += engine.nodes_reached;
+			result.stats += engine.stats;
+		}
+		results.push_back(result);
+		if (format == "table")
+			std::cout << "info threads " << threads << " done in " << result.seconds << " s" << std::endl;
+	}
+
+	const ScalingResult& base = results[0];
+	auto nps = [](const ScalingResult& r) {
+		return r.nodes / std::max(r.seconds, 1e-9);
+	};
+	auto ratio = [](double part, double whole) {
+		return whole == 0 ? 0.0 : part / whole;
+	};
+	if (format == "csv")
+		std::cout << "threads,seconds,nodes,nps,speedup,nps_scaling,node_overhead,tt_hit_rate,tt_foreign_hit_rate,tt_evictions_per_knode" << std::endl;
+	else if (format == "json")
+		std::cout << "{\"depth\": " << depth << ", \"deals\": " << deal_count << ", \"results\": [" << std::endl;
+	else
+		std::cout << "threads    seconds        nodes        nps  speedup  npsscale  overhead  tthit%  foreign%  evict/kn" << std::endl;
+	for (size_t i = 0; i < results.size(); i++) {
+		const ScalingResult& r = results[i];
+		double speedup = ratio(base.seconds, r.seconds);
+		double nps_scaling = ratio(nps(r), nps(base));
+		double node_overhead = ratio(r.nodes, base.nodes);
+		double hit_rate = ratio(r.stats.table_hits, r.stats.table_probes);
+		double foreign_rate = ratio(r.stats.table_foreign_hits, r.stats.table_hits);
+		double evictions = ratio(r.stats.table_evictions * 1000.0, r.nodes);
+		char line[256];
+		if (format == "csv")
+			snprintf(line, sizeof(line), "%d,%.4f,%llu,%.0f,%.3f,%.3f,%.3f,%.4f,%.4f,%.3f",
+				r.threads, r.seconds, (unsigned long long)r.nodes, nps(r), speedup, nps_scaling, node_overhead, hit_rate, foreign_rate, evictions);
+		else if (format == "json")
+			snprintf(line, sizeof(line), "  {\"threads\": %d, \"seconds\": %.4f, \"nodes\": %llu, \"nps\": %.0f, \"speedup\": %.3f, \"nps_scaling\": %.3f, "
+				"\"node_overhead\": %.3f, \"tt_hit_rate\": %.4f, \"tt_foreign_hit_rate\": %.4f, \"tt_evictions_per_knode\": %.3f}%s",
+				r.threads, r.seconds, (unsigned long long)r.nodes, nps(r), speedup, nps_scaling, node_overhead, hit_rate, foreign_rate, evictions,
+				i + 1 < results.size() ? "," : "");
+		else
+			snprintf(line, sizeof(line), "%7d %10.3f %12llu %10.0f %8.2f %9.2f %9.2f %7.1f %9.1f %9.2f",
+				r.threads, r.seconds, (unsigned long long)r.nodes, nps(r), speedup, nps_scaling, node_overhead, hit_rate * 100, foreign_rate * 100, evictions);
+		std::cout << line << std::endl;
+	}
+	if (format == "json")
+		std::cout << "]}" << std::endl;
+}
+
+// ===== Training data generation =====
+
+// Lock-free set of packed positions (which are never 0), with linear probing.
+struct ConcurrentPositionSet {
+	std::unique_ptr<std::atomic<uint64_t>[]> slots;
+	uint64_t mask;
+	std::atomic<uint64_t> count{0};
+
+	ConcurrentPositionSet(int log2_slots) : slots(new std::atomic<uint64_t>[1ull << log2_slots]), mask((1ull << log2_slots) - 1) {
+		for (uint64_t i = 0; i <= mask; i++)
+			slots[i] = 0;
+	}
+
+	bool full() const {
+		return count * 4 > mask * 3;
+	}
+
+	// Returns true if the position was not in the set yet.
+	bool insert(PackedPosition key) {
+		uint64_t index = (key * 0x9e3779b97f4a7c15ull) >> 20;
+		for (uint64_t probe = 0; probe <= mask; probe++) {
+			std::atomic<uint64_t>& slot = slots[(index + probe) & mask];
+			uint64_t current = slot.load(std::memory_order_relaxed);
+			if (current == key)
+				return false;
+			if (current == 0) {
+				if (slot.compare_exchange_strong(current, key)) {
+					count++;
+					return true;
+				}
+				if (current == key)
+					return false;
+			}
+		}
+		return false;
+	}
+};
+
+#pragma pack(push, 1)
+struct TrainingRecord {
+	PackedPosition position;
+	// Search score for the side to move.
+	int16_t score;
+	// Game result for the side to move: 1 win, 0 draw, -1 loss.
+	int8_t result;
+	uint8_t depth;
+};
+#pragma pack(pop)
+static_assert(sizeof(TrainingRecord) == 12, "TrainingRecord is part of the on-disk format");
+
+struct TrainingShardHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+constexpr char TRAINING_MAGIC[8] = {'O', 'N', 'I', 'D', 'A', 'T', 'A', 0};
+constexpr uint32_t TRAINING_VERSION = 1;
+
+// Appends records to numbered shard files, starting a new one every shard_records records.
+// Shards carry no record count, so they can be read as streams up to EOF.
+struct TrainingShardWriter {
+	std::string prefix;
+	uint64_t shard_records;
+	std::ofstream out;
+	int shard_index = 0;
+	uint64_t records_in_shard = 0;
+
+	TrainingShardWriter(const std::string& prefix, uint64_t shard_records) : prefix(prefix), shard_records(shard_records) {}
+
+	void write(const TrainingRecord& record) {
+		if (not out.is_open() or records_in_shard >= shard_records) {
+			if (out.is_open())
+				out.close();
+			std::string path = prefix + "-" + std::to_string(shard_index++) + ".bin";
+			out.open(path, std::ios::binary);
+			if (not out)
+				throw std::runtime_error("Failed to open shard: " + path);
+			TrainingShardHeader header{};
+			std::copy(TRAINING_MAGIC, TRAINING_MAGIC + 8, header.magic);
+			header.version = TRAINING_VERSION;
+			header.record_size = sizeof(TrainingRecord);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			records_in_shard = 0;
+		}
+		out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+		records_in_shard++;
+	}
+};
+
+// Options:
+//   --out PREFIX           shard path prefix; thread t writes PREFIX.t-N.bin (default data)
+//   --threads N            generator threads (default: all cores)
+//   --games N              games per thread (default 1000)
+//   --depth N              search depth for moves and labels (default 6)
+//   --random-plies N       uniformly random opening plies, for diversity (default 4)
+//   --shard-records N      records per shard file (default 1000000)
+//   --dedup-log2 N         log2 of the dedup set size (default 24)
+void generate_training_data(const Options& options) {
+	std::string prefix = get_option(options, "out", "data");
+	int thread_count = std::stoi(get_option(options, "threads", std::to_string(std::max(1u, std::thread::hardware_concurrency()))));
+	int games = std::stoi(get_option(options, "games", "1000"));
+	int depth = std::stoi(get_option(options, "depth", "6"));
+	int random_plies = std::stoi(get_option(options, "random-plies", "4"));
+	uint64_t shard_records = std::stoull(get_option(options, "shard-records", "1000000"));
+	ConcurrentPositionSet seen(std::stoi(get_option(options, "dedup-log2", "24")));
+	std::atomic<uint64_t> records_written{0};
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < thread_count; t++) {
+		threads.emplace_back([&, t]() {
+			OnitamaEngine engine;
+			engine.play_randomization = 20;
+			TrainingShardWriter writer(prefix + "." + std::to_string(t), shard_records);
+			for (int game = 0; game < games and not seen.full(); game++) {
+				Card hand_state[16];
+				for (int i = 0; i < 16; i++)
+					hand_state[i] = i;
+				std::shuffle(&hand_state[0], &hand_state[16], rng);
+				auto state = OnitamaState::starting_state(hand_state);
+				state.canonicalize();
+				engine.hash_history.clear();
+				std::vector<TrainingRecord> game_records;
+				std::vector<Player> record_turns;
+				for (int plies = 0; state.game_result() == Player::NOBODY and plies < 200; plies++) {
+					Move m;
+					if (plies < random_plies) {
+						Move moves[MAX_LEGAL_MOVES];
+						int move_count = state.move_gen(moves);
+						m = moves[std::uniform_int_distribution<int>(0, move_count - 1)(rng)];
+					} else {
+						m = engine.compute_best_move(state, depth);
+						PackedPosition packed = pack_position(state);
+						if (seen.insert(packed)) {
+							TrainingRecord record{};
+							record.position = packed;
+							record.score = std::max(-32767, std::min(32767, engine.last_score));
+							record.depth = depth;
+							game_records.push_back(record);
+							record_turns.push_back(state.turn);
+						}
+					}
+					engine.hash_history.push_back(state_to_hash(state));
+					state.make_move(m);
+					if (std::count(engine.hash_history.begin(), engine.hash_history.end(), state_to_hash(state)) >= 2)
+						break;
+				}
+				Player winner = state.game_result();
+				for (size_t i = 0; i < game_records.size(); i++) {
+					game_records[i].result = winner == Player::NOBODY ? 0 : winner == record_turns[i] ? 1 : -1;
+					writer.write(game_records[i]);
+				}
+				records_written += game_records.size();
+				if (game % 100 == 0)
+					std::cout << "[thread " << t << " game " << game << "] Records written: " << records_written << std::endl;
+			}
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+	std::cout << "Wrote " << records_written << " unique positions" << std::endl;
+}
+
+// ===== Opening book =====
+
+struct BookHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t entry_count;
+};
+
+struct BookEntry {
+	uint64_t hash;
+	Move move;
+	int16_t score;
+	uint8_t depth;
+	uint8_t ply;
+	uint16_t reserved;
+};
+static_assert(sizeof(BookEntry) == 16, "BookEntry is part of the on-disk format");
+
+constexpr char BOOK_MAGIC[8] = {'O', 'N', 'I', 'B', 'O', 'O', 'K', 0};
+constexpr uint32_t BOOK_VERSION = 1;
+
+// Best moves for opening positions, stored sorted by state_to_hash of the canonicalized state.
+struct OpeningBook {
+	MappedFile file;
+	const BookEntry* entries = nullptr;
+	uint64_t entry_count = 0;
+
+	bool open(const std::string& path) {
+		entries = nullptr;
+		entry_count = 0;
+		if (not file.open(path))
+			return false;
+		const BookHeader* header = static_cast<const BookHeader*>(file.data);
+		if (file.size < sizeof(BookHeader) or
+			not std::equal(BOOK_MAGIC, BOOK_MAGIC + 8, header->magic) or
+			header->version != BOOK_VERSION or
+			header->entry_size != sizeof(BookEntry) or
+			file.size != sizeof(BookHeader) + header->entry_count * sizeof(BookEntry)
+		) {
+			file.close();
+			return false;
+		}
+		entries = reinterpret_cast<const BookEntry*>(header + 1);
+		entry_count = header->entry_count;
+		return true;
+	}
+
+	// Returns nullptr if the position isn't in the book, or the book move isn't legal in it.
+	// The state must be canonicalized, as every state reached through make_move is.
+	const BookEntry* probe(const OnitamaState& state) const {
+		uint64_t hash = state_to_hash(state);
+		const BookEntry* it = std::lower_bound(entries, entries + entry_count, hash, [](const BookEntry& e, uint64_t h) {
+			return e.hash < h;
+		});
+		if (it == entries + entry_count or it->hash != hash)
+			return nullptr;
+		// Guard against hash collisions.
+		Move moves[MAX_LEGAL_MOVES];
+		int move_count = state.move_gen(moves);
+		if (std::find(moves, moves + move_count, it->move) == moves + move_count)
+			return nullptr;
+		return it;
+	}
+};
+
+static void expand_book_tree(OnitamaEngine& engine, OnitamaState state, int ply, int max_ply, int depth, std::vector<BookEntry>& out, std::unordered_set<uint64_t>& seen) {
+	if (ply >= max_ply or state.game_result() != Player::NOBODY)
+		return;
+	uint64_t hash = state_to_hash(state);
+	if (not seen.insert(hash).second)
+		return;
+	Move m = engine.compute_best_move(state, depth);
+	BookEntry entry{};
+	entry.hash = hash;
+	entry.move = m;
+	entry.score = std::max(-32767, std::min(32767, engine.last_score));
+	entry.depth = depth;
+	entry.ply = ply;
+	out.push_back(entry);
+
+	Move moves[MAX_LEGAL_MOVES];
+	int move_count = state.move_gen(moves);
+	for (int i = 0; i < move_count; i++) {
+		OnitamaState child_state = state;
+		child_state.make_move(moves[i]);
+		expand_book_tree(engine, child_state, ply + 1, max_ply, depth, out, seen);
+	}
+}
+
+// Searches every position up to max_ply plies deep from every card deal, and writes the results to path.
+void build_opening_book(const std::string& path, int max_ply, int depth, int thread_count, int deal_limit) {
+	// Every deal, with both hands already in canonical (sorted) order.
+	std::vector<std::array<Card, 5>> deals;
+	for (Card swap = 0; swap < 16; swap++)
+		for (Card w0 = 0; w0 < 16; w0++)
+			for (Card w1 = w0 + 1; w1 < 16; w1++)
+				for (Card b0 = 0; b0 < 16; b0++)
+					for (Card b1 = b0 + 1; b1 < 16; b1++) {
+						std::array<Card, 5> deal{w0, w1, b0, b1, swap};
+						std::array<Card, 5> sorted = deal;
+						std::sort(sorted.begin(), sorted.end());
+						if (std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end())
+							deals.push_back(deal);
+					}
+	if (deal_limit > 0 and size_t(deal_limit) < deals.size())
+		deals.resize(deal_limit);
+	std::cout << "Building book over " << deals.size() << " deals to ply " << max_ply << " at depth " << depth << std::endl;
+
+	// With no threads nothing would be searched, and the book would silently come out empty.
+	thread_count = std::max(1, thread_count);
+	std::atomic<size_t> next_deal{0};
+	std::vector<std::vector<BookEntry>> results(thread_count);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < thread_count; t++) {
+		threads.emplace_back([&, t]() {
+			OnitamaEngine engine;
+			engine.play_randomization = 0;
+			std::unordered_set<uint64_t> seen;
+			size_t i;
+			while ((i = next_deal++) < deals.size()) {
+				auto state = OnitamaState::starting_state(deals[i].data());
+				expand_book_tree(engine, state, 0, max_ply, depth, results[t], seen);
+				if (i % 1000 == 0)
+					std::cout << "[" << i << "] Book entries so far in thread " << t << ": " << results[t].size() << std::endl;
+			}
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	std::vector<BookEntry> entries;
+	for (auto& r : results)
+		entries.insert(entries.end(), r.begin(), r.end());
+	std::sort(entries.begin(), entries.end(), [](const BookEntry& a, const BookEntry& b) {
+		return a.hash < b.hash;
+	});
+	entries.erase(std::unique(entries.begin(), entries.end(), [](const BookEntry& a, const BookEntry& b) {
+		return a.hash == b.hash;
+	}), entries.end());
+
+	BookHeader header{};
+	std::copy(BOOK_MAGIC, BOOK_MAGIC + 8, header.magic);
+	header.version = BOOK_VERSION;
+	header.entry_size = sizeof(BookEntry);
+	header.entry_count = entries.size();
+	std::ofstream f(path, std::ios::binary);
+	f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	f.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(BookEntry));
+	if (not f)
+		throw std::runtime_error("Failed to write book: " + path);
+	std::cout << "Wrote " << entries.size() << " entries to " << path << std::endl;
+}
+
+// ===== Distributed analysis =====
+
+// A coordinator splits the root moves of a search across worker processes, local or on other machines.
+// Workers speak a line protocol over TCP, with scores from the child's side to move as pvs returns them:
+//   search <packed child> <depth> <alpha> <beta> <history length> <hashes...>  ->  result <score> <nodes>
+//   quit
+// A worker answers a malformed search, or one outside its bounds, with "error" instead of searching it.
+
+struct LineConnection {
+	int fd = -1;
+	std::string buffer;
+
+	bool send_line(const std::string& line) {
+		std::string data = line + "\n";
+		size_t sent = 0;
+		while (sent < data.size()) {
+			ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0)
+				return false;
+			sent += n;
+		}
+		return true;
+	}
+
+	// Appends whatever has arrived to the buffer. Returns false on EOF or error.
+	bool fill() {
+		char chunk[4096];
+		ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n <= 0)
+			return false;
+		buffer.append(chunk, n);
+		return true;
+	}
+
+	bool take_line(std::string& line) {
+		size_t newline = buffer.find('\n');
+		if (newline == std::string::npos)
+			return false;
+		line = buffer.substr(0, newline);
+		buffer.erase(0, newline + 1);
+		return true;
+	}
+
+	bool read_line(std::string& line) {
+		while (not take_line(line))
+			if (not fill())
+				return false;
+		return true;
+	}
+
+	void close() {
+		if (fd != -1)
+			::close(fd);
+		fd = -1;
+		buffer.clear();
+	}
+};
+
+static sockaddr_in parse_endpoint(const std::string& endpoint) {
+	size_t colon = endpoint.rfind(':');
+	sockaddr_in address{};
+	address.sin_family = AF_INET;
+	if (colon == std::string::npos or inet_pton(AF_INET, endpoint.substr(0, colon).c_str(), &address.sin_addr) != 1)
+		throw std::runtime_error("Bad endpoint: " + endpoint);
+	address.sin_port = htons(std::stoi(endpoint.substr(colon + 1)));
+	return address;
+}
+
+// Keeps trying for retry_seconds, since a freshly started worker may not be listening yet.
+static int connect_endpoint(const std::string& endpoint, double retry_seconds) {
+	sockaddr_in address = parse_endpoint(endpoint);
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(retry_seconds);
+	while (true) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(fd, (sockaddr*)&address, sizeof(address)) == 0) {
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			return fd;
+		}
+		::close(fd);
+		if (std::chrono::steady_clock::now() >= deadline)
+			return -1;
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+}
+
+// Bounds on what a worker accepts in a search request. pvs indexes its per depth tables by depth.
+constexpr int MAX_WORKER_DEPTH = 50;
+constexpr size_t MAX_WORKER_HISTORY = 1 << 16;
+
+void run_worker(const Options& options) {
+	std::string endpoint = get_option(options, "listen", "127.0.0.1:" + get_option(options, "port", "7700"));
+	// Exit without answering once this many jobs are done, to exercise the coordinator's recovery.
+	int fail_after = std::stoi(get_option(options, "fail-after", "-1"));
+	sockaddr_in address = parse_endpoint(endpoint);
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 or listen(listener, 4) != 0)
+		throw std::runtime_error("Failed to listen on " + endpoint);
+	// One engine for the whole session, so the move order table stays warm from job to job.
+	OnitamaEngine engine;
+	int jobs_done = 0;
+	while (true) {
+		LineConnection connection;
+		connection.fd = accept(listener, nullptr, nullptr);
+		if (connection.fd < 0)
+			continue;
+		setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		std::string line;
+		while (connection.read_line(line)) {
+			std::istringstream in(line);
+			std::string cmd;
+			in >> cmd;
+			if (cmd == "quit") {
+				connection.close();
+				::close(listener);
+				return;
+			}
+			if (cmd != "search")
+				continue;
+			if (jobs_done == fail_after)
+				_exit(1);
+			// The line comes off the network, so check all of it before searching anything.
+			PackedPosition packed = 0;
+			int depth = 0, alpha = 0, beta = 0;
+			size_t history_length = 0;
+			bool valid = bool(in >> packed >> depth >> alpha >> beta >> history_length) and valid_packed_position(packed)
+				and depth >= 1 and depth <= MAX_WORKER_DEPTH and alpha < beta and history_length <= MAX_WORKER_HISTORY;
+			if (valid) {
+				engine.hash_history.resize(history_length);
+				for (uint64_t& h : engine.hash_history)
+					valid = valid and bool(in >> h);
+			}
+			if (not valid) {
+				engine.hash_history.clear();
+				if (not connection.send_line("error bad search"))
+					break;
+				continue;
+			}
+			OnitamaState state = unpack_position(packed);
+			uint64_t nodes_before = engine.nodes_reached;
+			// The child is one ply below the coordinator's root, whose hash ends the history.
+			engine.ply = 1;
+			// Cheap full window passes order the moves for the windowed search that counts.
+			for (int d = 1; d < depth; d++)
+				engine.pvs(state, d, -SCORE_INF, SCORE_INF);
+			int score = engine.pvs(state, depth, alpha, beta);
+			engine.ply = 0;
+			jobs_done++;
+			if (not connection.send_line("result " + std::to_string(score) + " " + std::to_string(engine.nodes_reached - nodes_before)))
+				break;
+		}
+		connection.close();
+	}
+}
+
+// One root move searched with the root window [alpha, beta].
+struct RootJob {
+	int move_index;
+	int alpha;
+	int beta;
+};
+
+struct WorkerSlot {
+	std::string endpoint;
+	LineConnection connection;
+	// Set for workers we started ourselves.
+	pid_t pid = -1;
+	bool busy = false;
+	RootJob job;
+	std::chrono::steady_clock::time_point job_start;
+
+	// Kills a worker we started, so that none linger after being dropped.
+	void stop_process() {
+		if (pid == -1)
+			return;
+		kill(pid, SIGTERM);
+		waitpid(pid, nullptr, 0);
+		pid = -1;
+	}
+};
+
+// Stops the workers we started however the coordinator exits, exceptions included.
+struct SpawnedWorkerGuard {
+	std::vector<WorkerSlot>& workers;
+
+	~SpawnedWorkerGuard() {
+		for (WorkerSlot& worker : workers)
+			worker.stop_process();
+	}
+};
+
+// Searches the root moves of state in parallel on the workers, one iteration per depth.
+// The eldest move is searched with a full window first, then the rest with scout windows
+// at the best score so far, re-searching those that fail high, as pvs does.
+void coordinate_search(const Options& options) {
+	std::vector<std::string> card_names_given;
+	{
+		std::istringstream in(get_option(options, "cards", "monkey,crane,tiger,crab,dragon"));
+		std::string name;
+		while (std::getline(in, name, ','))
+			card_names_given.push_back(name);
+	}
+	if (card_names_given.size() != 5)
+		throw std::runtime_error("--cards needs five card names");
+	Card hand_state[5];
+	for (int i = 0; i < 5; i++)
+		hand_state[i] = parse_card_name(card_names_given[i]);
+	OnitamaState state = OnitamaState::starting_state(hand_state);
+	state.canonicalize();
+	std::vector<uint64_t> hash_history;
+	{
+		std::istringstream in(get_option(options, "moves"));
+		std::string move_text;
+		while (std::getline(in, move_text, ',')) {
+			std::istringstream fields(move_text);
+			std::string card_name;
+			int source_x, source_y, dest_x, dest_y;
+			if (not (fields >> card_name >> source_x >> source_y >> dest_x >> dest_y))
+				throw std::runtime_error("Bad move: " + move_text);
+			Move m = find_move(state, parse_card_name(card_name), source_x, source_y, dest_x, dest_y);
+			if (m == BAD_MOVE)
+				throw std::runtime_error("Illegal move: " + move_text);
+			hash_history.push_back(state_to_hash(state));
+			state.make_move(m);
+		}
+	}
+	if (state.game_result() != Player::NOBODY)
+		throw std::runtime_error("The game is already over");
+
+	std::vector<WorkerSlot> workers;
+	SpawnedWorkerGuard worker_guard{workers};
+	if (options.count("workers")) {
+		std::istringstream in(get_option(options, "workers"));
+		std::string endpoint;
+		while (std::getline(in, endpoint, ',')) {
+			workers.emplace_back();
+			workers.back().endpoint = endpoint;
+		}
+	} else {
+		int spawn = std::stoi(get_option(options, "spawn", std::to_string(std::max(1u, std::thread::hardware_concurrency()))));
+		int base_port = std::stoi(get_option(options, "base-port", "7700"));
+		for (int i = 0; i < spawn; i++) {
+			std::string port = std::to_string(base_port + i);
+			pid_t pid = fork();
+			if (pid == 0) {
+				execl("/proc/self/exe", "onitama", "worker", "--port", port.c_str(), (char*)nullptr);
+				_exit(127);
+			}
+			workers.emplace_back();
+			workers.back().endpoint = "127.0.0.1:" + port;
+			workers.back().pid = pid;
+		}
+	}
+	for (WorkerSlot& worker : workers) {
+		worker.connection.fd = connect_endpoint(worker.endpoint, 5.0);
+		if (worker.connection.fd < 0)
+			std::cout << "info Failed to connect to worker " << worker.endpoint << std::endl;
+	}
+
+	// Iterations start at depth 2, so every job searches its child at least a ply deep.
+	int max_depth = std::max(2, std::stoi(get_option(options, "depth", "10")));
+	// Seconds before a silent worker is given up on; zero waits forever.
+	double job_timeout = std::stod(get_option(options, "job-timeout", "0"));
+
+	Move root_moves[MAX_LEGAL_MOVES];
+	int move_count = state.move_gen(root_moves);
+	std::vector<Move> order(root_moves, root_moves + move_count);
+	std::vector<PackedPosition> children(move_count);
+	std::vector<uint64_t> job_history = hash_history;
+	job_history.push_back(state_to_hash(state));
+	std::string history_text = std::to_string(job_history.size());
+	for (uint64_t h : job_history)
+		history_text += " " + std::to_string(h);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	uint64_t total_nodes = 0;
+	Move best_move = order[0];
+	// Workers only take positions still in play, so a move that wins outright is played without a search.
+	for (Move m : order) {
+		OnitamaState child = state;
+		child.make_move(m);
+		if (child.game_result() != Player::NOBODY) {
+			best_move = m;
+			max_depth = 0;
+			break;
+		}
+	}
+
+	for (int depth = 2; depth <= max_depth; depth++) {
+		for (int i = 0; i < move_count; i++) {
+			OnitamaState child = state;
+			child.make_move(order[i]);
+			children[i] = pack_position(child);
+		}
+		std::vector<int> scores(move_count, -SCORE_INF);
+		int alpha = -SCORE_INF;
+		int best_index = 0;
+		int unfinished = move_count;
+		bool siblings_queued = false;
+		std::deque<RootJob> pending{{0, -SCORE_INF, SCORE_INF}};
+
+		auto drop_worker = [&pending](WorkerSlot& worker) {
+			std::cout << "info Lost worker " << worker.endpoint << std::endl;
+			if (worker.busy)
+				pending.push_front(worker.job);
+			worker.busy = false;
+			worker.connection.close();
+			worker.stop_process();
+		};
+
+		auto handle_result = [&](const RootJob& job, int score) {
+			if (score > job.alpha and score < job.beta) {
+				scores[job.move_index] = score;
+				unfinished--;
+				if (score > alpha) {
+					alpha = score;
+					best_index = job.move_index;
+				}
+			} else if (score <= job.alpha) {
+				scores[job.move_index] = score;
+				unfinished--;
+			} else {
+				// A fail high against the current best earns a real search; against a stale one, another scout.
+				pending.push_front({job.move_index, alpha, job.alpha == alpha ? SCORE_INF : alpha + 1});
+			}
+			if (not siblings_queued and job.move_index == 0 and unfinished < move_count) {
+				siblings_queued = true;
+				for (int i = 1; i < move_count; i++)
+					pending.push_back({i, alpha, alpha + 1});
+			}
+		};
+
+		while (unfinished > 0) {
+			int live = 0;
+			for (WorkerSlot& worker : workers) {
+				if (worker.connection.fd < 0)
+					continue;
+				if (not worker.busy and not pending.empty()) {
+					RootJob job = pending.front();
+					pending.pop_front();
+					std::string line = "search " + std::to_string(children[job.move_index]) + " " + std::to_string(depth - 1);
+					line += " " + std::to_string(-job.beta) + " " + std::to_string(-job.alpha) + " " + history_text;
+					worker.busy = true;
+					worker.job = job;
+					worker.job_start = std::chrono::steady_clock::now();
+					if (not worker.connection.send_line(line)) {
+						drop_worker(worker);
+						continue;
+					}
+				}
+				live++;
+			}
+			if (live == 0)
+				throw std::runtime_error("No workers left");
+
+			std::vector<pollfd> poll_fds;
+			std::vector<WorkerSlot*> polled;
+			for (WorkerSlot& worker : workers) {
+				if (worker.busy) {
+					poll_fds.push_back({worker.connection.fd, POLLIN, 0});
+					polled.push_back(&worker);
+				}
+			}
+			poll(poll_fds.data(), poll_fds.size(), 100);
+			for (size_t i = 0; i < polled.size(); i++) {
+				WorkerSlot& worker = *polled[i];
+				if (poll_fds[i].revents == 0) {
+					double waited = std::chrono::duration<double>(std::chrono::steady_clock::now() - worker.job_start).count();
+					if (job_timeout > 0 and waited > job_timeout)
+						drop_worker(worker);
+					continue;
+				}
+				if (not worker.connection.fill()) {
+					drop_worker(worker);
+					continue;
+				}
+				std::string line;
+				while (worker.busy and worker.connection.take_line(line)) {
+					std::istringstream in(line);
+					std::string cmd;
+					int score;
+					uint64_t nodes;
+					if (not (in >> cmd >> score >> nodes) or cmd != "result") {
+						drop_worker(worker);
+						break;
+					}
+					worker.busy = false;
+					total_nodes += nodes;
+					handle_result(worker.job, -score);
+				}
+			}
+		}
+
+		best_move = order[best_index];
+		int root_score = make_mate_scores_slightly_less_extreme(alpha);
+		// Search the best move first next time, then the rest by how well they did.
+		std::vector<int> rank(move_count);
+		for (int i = 0; i < move_count; i++)
+			rank[i] = i;
+		std::stable_sort(rank.begin(), rank.end(), [&](int a, int b) {
+			return (a == best_index) > (b == best_index) or ((a == best_index) == (b == best_index) and scores[a] > scores[b]);
+		});
+		std::vector<Move> new_order(move_count);
+		for (int i = 0; i < move_count; i++)
+			new_order[i] = order[rank[i]];
+		order = new_order;
+
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		int live = 0;
+		for (const WorkerSlot& worker : workers)
+			live += worker.connection.fd >= 0;
+		std::cout << "info depth " << depth << " score " << root_score << " nodes " << total_nodes;
+		std::cout << " nps " << uint64_t(total_nodes / std::max(elapsed.count(), 1e-6)) << " time " << int(elapsed.count() * 1e3);
+		std::cout << " workers " << live << " pv " << move_to_protocol_string(state, best_move) << std::endl;
+	}
+	std::cout << "bestmove " << move_to_protocol_string(state, best_move) << std::endl;
+
+	// Workers we started are told to exit (and stopped by worker_guard); shared ones just see us hang up.
+	for (WorkerSlot& worker : workers) {
+		if (worker.pid != -1 and worker.connection.fd >= 0)
+			worker.connection.send_line("quit");
+		worker.connection.close();
+	}
+}
+
+// Searches random deals to a fixed depth and dumps the sampled nodes for analyzetrace.
+void trace_search(const Options& options) {
+#ifdef SEARCH_TRACE
+	std::string path = get_option(options, "out", "search.trace");
+	int depth = std::stoi(get_option(options, "depth", "9"));
+	int deals = std::stoi(get_option(options, "deals", "6"));
+	OnitamaEngine engine;
+	engine.trace.sample_interval = std::stoi(get_option(options, "interval", "16"));
+	engine.trace.resize(size_t(1) << std::stoi(get_option(options, "capacity-log2", "20")));
+	for (int deal = 0; deal < deals; deal++) {
+		Card hand_state[16];
+		for (int i = 0; i < 16; i++)
+			hand_state[i] = i;
+		std::shuffle(&hand_state[0], &hand_state[16], rng);
+		OnitamaState state = OnitamaState::starting_state(hand_state);
+		state.canonicalize();
+		engine.move_order_table.clear();
+		for (int d = 1; d <= depth; d++)
+			engine.pvs(state, d, -SCORE_INF, SCORE_INF);
+	}
+	engine.trace.dump(path);
+	std::cout << "Wrote " << std::min<uint64_t>(engine.trace.sampled, engine.trace.ring.size()) << " records to " << path << std::endl;
+#else
+	(void)options;
+	throw std::runtime_error("Built without SEARCH_TRACE");
+#endif
+}
+
+void uoi(const Options& options) {
+	OnitamaEngine engine;
+	engine.print_info = true;
+	engine.eval_weights = parse_eval_weights(get_option(options, "eval-weights"));
+	engine.extensions = parse_search_extensions(get_option(options, "extensions"));
+	engine.thread_count = std::stoi(get_option(options, "threads", "1"));
+	// Proof numbers a solve may store, shared by its threads.
+	size_t solve_table_entries = std::stoull(get_option(options, "solve-table-entries", std::to_string(1 << 24)));
+	// With --trace, the sampled nodes of the whole session are dumped there on quit.
+	std::string trace_path = get_option(options, "trace");
+#ifndef SEARCH_TRACE
+	if (not trace_path.empty())
+		std::cout << "info Built without SEARCH_TRACE, not tracing" << std::endl;
+#endif
+	// With --engine mcts, genmove uses MCTS (evaluating with engine's tables) instead of pvs.
+	bool use_mcts = get_option(options, "engine", "pvs") == "mcts";
+	MctsEngine mcts(engine);
+	mcts.print_info = true;
+	mcts.thread_count = std::stoi(get_option(options, "threads", "1"));
+	mcts.evaluation = get_option(options, "mcts-eval", "playout") == "heuristic" ? MCTS_HEURISTIC : MCTS_PLAYOUT;
+	OpeningBook book;
+	std::string book_path = get_option(options, "book");
+	if (not book_path.empty() and not book.open(book_path))
+		std::cout << "info Failed to load book: " << book_path << std::endl;
+	if (options.count("hash-mb") or options.count("pages") or options.count("numa")) {
+		MemoryPolicy policy;
+		policy.page_mode = parse_page_mode(get_option(options, "pages", "thp"));
+		std::string numa = get_option(options, "numa", "off");
+		policy.numa_interleave = numa == "interleave";
+		if (numa != "off" and numa != "interleave")
+			policy.numa_node = std::stoi(numa);
+		engine.move_order_table.resize_megabytes(std::stoull(get_option(options, "hash-mb", "32")), policy);
+		std::cout << "info hash " << (engine.move_order_table.entry_count * sizeof(uint64_t) >> 20) << " MB pages " << page_mode_name(engine.move_order_table.buffer.page_mode) << std::endl;
+	}
+	AnalysisCache analysis_cache;
+	std::string cache_path = get_option(options, "cache");
+	if (not cache_path.empty()) {
+		int log2_entries = std::stoi(get_option(options, "cache-log2-entries", "24"));
+		bool writable = get_option(options, "cache-readonly").empty();
+		if (analysis_cache.open(cache_path, log2_entries, writable, engine.eval_fingerprint())) {
+			analysis_cache.min_depth = std::stoi(get_option(options, "cache-min-depth", "6"));
+			engine.analysis_cache = &analysis_cache;
+		} else {
+			std::cout << "info Failed to open analysis cache: " << cache_path << std::endl;
+		}
+	}
 	Card hand_state[5] = {1, 2, 3, 4, 5};
 	OnitamaState state = OnitamaState::starting_state(hand_state);
 	auto get_card = []() {
@@ -960,39 +3994,21 @@ void uoi() {
 			for (int i = 0; i < 5; i++)
 				hand_state[i] = get_card();
 			state = OnitamaState::starting_state(hand_state);
+			// Book moves refer to hand indices of the canonical state.
+			state.canonicalize();
+			engine.hash_history.clear();
 			std::cout << "info new game." << std::endl;
 //			print_state(state);
 		}
 		if (cmd == "move") {
 			Card c = get_card();
-			// Find the card that matches in our hand.
-			const Card* our_hand = state.turn == Player::WHITE ? state.white_hand : state.black_hand;
-			int hand_index;
-			if (our_hand[0] == c) {
-				hand_index = 0;
-			} else if (our_hand[1] == c) {
-				hand_index = 1;
-			} else {
-				assert(false);
-			}
 			int source_x = get_int();
 			int source_y = get_int();
 			int dest_x = get_int();
 			int dest_y = get_int();
-			Move moves[MAX_LEGAL_MOVES];
-			int move_count = state.move_gen(moves);
-			Move found_move = BAD_MOVE;
-			for (int i = 0; i < move_count; i++) {
-				Move m = moves[i];
-				Square dest = m;
-				int piece_index = (m >> 8) & 7;
-				int m_hand_index = (m >> 11) & 1;
-				const Square* our_pieces = state.turn == Player::WHITE ? state.white_pieces : state.black_pieces;
-				Square source = our_pieces[piece_index];
-				if (source == offset_to_delta({source_x, source_y}) and dest == offset_to_delta({dest_x, dest_y}) and hand_index == m_hand_index)
-					found_move = m;
-			}
+			Move found_move = find_move(state, c, source_x, source_y, dest_x, dest_y);
 			assert(found_move != BAD_MOVE);
+			engine.hash_history.push_back(state_to_hash(state));
 			state.make_move(found_move);
 			std::cout << "info Making move: " << found_move << std::endl;
 //			print_state(state);
@@ -1000,7 +4016,8 @@ void uoi() {
 		if (cmd == "genmove") {
 			int ms = get_int();
 //			std::cout << "info Thinking for: " << ms << std::endl;
-			// Apply a little bit of safety.
+			// Apply a little bit of safety for thread wakeup and pipe latency; the
+			// time manager decides how much of the rest to actually use.
 			ms = std::min(ms, std::max(5, ms - 10));
 			// Adjudicate the game.
 			if (state.game_result() != Player::NOBODY) {
@@ -1010,32 +4027,264 @@ void uoi() {
 					std::cout << "bestmove loss" << std::endl;
 				continue;
 			}
-			Move m = engine.compute_best_move(state, 50, ms * 1e-3);
-			Square dest = m;
-			int piece_index = (m >> 8) & 7;
-			const Square* our_pieces = state.turn == Player::WHITE ? state.white_pieces : state.black_pieces;
-			Square source = our_pieces[piece_index];
-			int m_hand_index = (m >> 11) & 1;
-			const Card* our_hand = state.turn == Player::WHITE ? state.white_hand : state.black_hand;
+			Move m;
+			if (const BookEntry* entry = book.probe(state)) {
+				m = entry->move;
+				std::cout << "info book depth " << int(entry->depth) << " score " << entry->score << std::endl;
+			} else if (use_mcts) {
+				m = mcts.compute_best_move(state, std::numeric_limits<uint64_t>::max(), ms * 1e-3);
+			} else {
+				m = engine.compute_best_move(state, 50, ms * 1e-3);
+			}
 //			std::cout << "Our move: " << m << std::endl;
-//			std::cout << "Piece: " << piece_index << std::endl;
-			std::cout << "bestmove " << card_names[our_hand[m_hand_index]] << " " << (source % 8) << " " << (source / 8) << " " << (dest % 8) << " " << (dest / 8) << std::endl;
+			std::cout << "bestmove " << move_to_protocol_string(state, m) << std::endl;
 //			state.make_move(m);
 //			print_state(state);
 		}
+		if (cmd == "solve") {
+			uint64_t node_budget = get_int();
+			int threads = get_int();
+			SolveResult result = solve_position(state, node_budget, std::max(1, threads), solve_table_entries);
+			std::cout << "info solve nodes " << result.nodes << " prooftree " << result.proof_tree_size;
+			std::cout << " time " << int(result.seconds * 1e3) << " nps " << uint64_t(result.nodes / std::max(result.seconds, 1e-6)) << std::endl;
+			std::cout << "solved " << (result.outcome == PROVEN_WIN ? "win" : result.outcome == PROVEN_LOSS ? "loss" : "unknown") << std::endl;
+		}
 		if (cmd == "quit") {
+#ifdef SEARCH_TRACE
+			if (not trace_path.empty())
+				engine.trace.dump(trace_path);
+#endif
 			return;
 		}
 	}
 }
 
-int main() {
-	setup_onitama();
+// ===== C API =====
 
-//	uoi();
-//	return 0;
+// Built into libonitama.so by "make libonitama.so", for drivers that would rather call the
+// engine in process (e.g. Python through ctypes) than speak uoi over pipes.
+// Moves use the engine's 16 bit encoding, positions the 64 bit packed format, and
+// scores are from the side to move. Functions that can fail return a negative value.
+
+struct OnitamaSession {
+	OnitamaEngine engine;
+	OnitamaState state;
+};
+
+extern "C" {
+
+OnitamaSession* onitama_new() {
+	OnitamaSession* session = new OnitamaSession;
+	Card hand_state[5] = {0, 1, 2, 3, 4};
+	session->state = OnitamaState::starting_state(hand_state);
+	session->state.canonicalize();
+	return session;
+}
+
+void onitama_free(OnitamaSession* session) {
+	delete session;
+}
+
+void onitama_set_threads(OnitamaSession* session, int threads) {
+	session->engine.thread_count = std::max(1, threads);
+}
+
+int onitama_card_index(const char* name) {
+	for (int i = 0; i < CARD_COUNT; i++)
+		if (std::string(card_names[i]) == name)
+			return i;
+	return -1;
+}
+
+const char* onitama_card_name(int card) {
+	return card >= 0 and card < CARD_COUNT ? card_names[card] : nullptr;
+}
+
+// cards are the two white cards, the two black cards, then the swap card, as in uoi's newgame.
+int onitama_new_game(OnitamaSession* session, const int* cards) {
+	Card hand_state[5];
+	for (int i = 0; i < 5; i++) {
+		if (cards[i] < 0 or cards[i] >= CARD_COUNT)
+			return -1;
+		hand_state[i] = cards[i];
+	}
+	session->state = OnitamaState::starting_state(hand_state);
+	session->state.canonicalize();
+	session->engine.hash_history.clear();
+	return 0;
+}
+
+// Sets a position with no game history, so repetitions before it are not known.
+int onitama_set_position(OnitamaSession* session, uint64_t packed) {
+	if (not valid_packed_position(packed))
+		return -1;
+	session->state = unpack_position(packed);
+	session->engine.hash_history.clear();
+	return 0;
+}
+
+uint64_t onitama_get_position(const OnitamaSession* session) {
+	return pack_position(session->state);
+}
+
+int onitama_turn(const OnitamaSession* session) {
+	return session->state.turn;
+}
+
+// 0 if white has won, 1 if black has, 2 while the game goes on.
+int onitama_game_result(const OnitamaSession* session) {
+	return session->state.game_result();
+}
+
+// Writes up to capacity legal moves and returns how many there are.
+int onitama_legal_moves(const OnitamaSession* session, uint16_t* moves, int capacity) {
+	if (session->state.game_result() != Player::NOBODY)
+		return 0;
+	Move generated[MAX_LEGAL_MOVES];
+	int move_count = session->state.move_gen(generated);
+	std::copy(generated, generated + std::min(move_count, capacity), moves);
+	return move_count;
+}
+
+// Describes move in the terms uoi uses: the card and the source and destination squares.
+int onitama_move_info(const OnitamaSession* session, uint16_t move, int* card, int* source_x, int* source_y, int* dest_x, int* dest_y) {
+	const Square* our_pieces = session->state.turn == Player::WHITE ? session->state.white_pieces : session->state.black_pieces;
+	const Card* our_hand = session->state.turn == Player::WHITE ? session->state.white_hand : session->state.black_hand;
+	int piece_index = (move >> 8) & 7;
+	if (piece_index >= 5 or our_pieces[piece_index] == PIECE_CAPTURED)
+		return -1;
+	Square source = our_pieces[piece_index];
+	Square dest = move;
+	*card = our_hand[(move >> 11) & 1];
+	*source_x = source % 8;
+	*source_y = source / 8;
+	*dest_x = dest % 8;
+	*dest_y = dest / 8;
+	return 0;
+}
+
+int onitama_find_move(const OnitamaSession* session, int card, int source_x, int source_y, int dest_x, int dest_y) {
+	if (session->state.game_result() != Player::NOBODY or card < 0 or card >= CARD_COUNT)
+		return -1;
+	Move m = find_move(session->state, card, source_x, source_y, dest_x, dest_y);
+	return m == BAD_MOVE ? -1 : m;
+}
+
+int onitama_apply_move(OnitamaSession* session, uint16_t move) {
+	if (session->state.game_result() != Player::NOBODY)
+		return -1;
+	Move moves[MAX_LEGAL_MOVES];
+	int move_count = session->state.move_gen(moves);
+	if (std::find(moves, moves + move_count, move) == moves + move_count)
+		return -1;
+	session->engine.hash_history.push_back(state_to_hash(session->state));
+	session->state.make_move(move);
+	return 0;
+}
+
+// Searches to max_depth, or until seconds run out if seconds is positive, and returns the best move.
+int onitama_search(OnitamaSession* session, int max_depth, double seconds, int* score, uint64_t* nodes) {
+	if (session->state.game_result() != Player::NOBODY or max_depth < 1)
+		return -1;
+	uint64_t nodes_before = session->engine.nodes_reached;
+	// Only a completed iteration sets the score, so don't report the previous search's.
+	session->engine.last_score = 0;
+	Move m = session->engine.compute_best_move(session->state, max_depth, seconds > 0 ? seconds : -1);
+	if (m == BAD_MOVE)
+		return -1;
+	if (score != nullptr)
+		*score = session->engine.last_score;
+	if (nodes != nullptr)
+		*nodes = session->engine.nodes_reached - nodes_before;
+	return m;
+}
+
+// Scores count packed positions: statically at depth 0, otherwise with a full window search to depth.
+// The positions are searched without game history, and the move order table is shared between them.
+// The session's own game history is kept. Fails without scoring anything if a position is invalid.
+int onitama_score_positions(OnitamaSession* session, const uint64_t* packed, int count, int depth, int* scores) {
+	for (int i = 0; i < count; i++)
+		if (not valid_packed_position(packed[i]))
+			return -1;
+	OnitamaEngine& engine = session->engine;
+	std::vector<uint64_t> game_history = std::move(engine.hash_history);
+	engine.hash_history.clear();
+	for (int i = 0; i < count; i++) {
+		OnitamaState state = unpack_position(packed[i]);
+		if (depth <= 0) {
+			scores[i] = engine.heuristic_score(state);
+			continue;
+		}
+		engine.ply = 0;
+		for (int d = 1; d <= depth; d++)
+			scores[i] = engine.pvs(state, d, -SCORE_INF, SCORE_INF);
+	}
+	engine.hash_history = std::move(game_history);
+	return 0;
+}
+
+}
+
+#ifndef ONITAMA_LIBRARY
+int main(int argc, char** argv) {
+	std::string mode = argc > 1 ? argv[1] : "";
+	if (mode == "uoi") {
+		uoi(parse_options(argc, argv, 2));
+		return 0;
+	}
+	if (mode == "elo") {
+		do_elo_testing(parse_options(argc, argv, 2));
+		return 0;
+	}
+	if (mode == "perfbench") {
+		do_perf_benchmark(parse_options(argc, argv, 2));
+		return 0;
+	}
+	if (mode == "scalebench") {
+		do_thread_scaling_benchmark(parse_options(argc, argv, 2));
+		return 0;
+	}
+	if (mode == "datagen") {
+		generate_training_data(parse_options(argc, argv, 2));
+		return 0;
+	}
+	if (mode == "worker") {
+		run_worker(parse_options(argc, argv, 2));
+		return 0;
+	}
+	if (mode == "coordinate") {
+		// Caught here, since only unwinding the stack lets coordinate_search stop its spawned workers.
+		try {
+			coordinate_search(parse_options(argc, argv, 2));
+		} catch (const std::exception& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+	if (mode == "tracesearch") {
+		trace_search(parse_options(argc, argv, 2));
+		return 0;
+	}
+	if (mode == "analyzetrace") {
+		if (argc < 3) {
+			std::cerr << "Usage: " << argv[0] << " analyzetrace <path>" << std::endl;
+			return 1;
+		}
+		analyze_trace(argv[2]);
+		return 0;
+	}
+	if (mode == "buildbook") {
+		if (argc < 5) {
+			std::cerr << "Usage: " << argv[0] << " buildbook <path> <max_ply> <depth> [threads] [deal_limit]" << std::endl;
+			return 1;
+		}
+		int threads = argc > 5 ? std::stoi(argv[5]) : int(std::max(1u, std::thread::hardware_concurrency()));
+		int deal_limit = argc > 6 ? std::stoi(argv[6]) : 0;
+		build_opening_book(argv[2], std::stoi(argv[3]), std::stoi(argv[4]), threads, deal_limit);
+		return 0;
+	}
 
-//	do_elo_testing();
 //	do_self_play_piece_table_calibration();
 //	return 0;
 
@@ -1089,4 +4338,4 @@ int main() {
 	std::cout << "Total nodes: " << nodes_reached << std::endl;
 */
 }
-
+#endif